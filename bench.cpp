@@ -0,0 +1,295 @@
+#define FTP_CLIENT_NO_MAIN
+#include "main.cpp"
+
+#include <regex>
+
+static FtpEntry parse_ftp_entry_regex(const std::string& line) {
+    std::regex re("([drwx\\-]+)\\s+\\d+\\s+[^\\s]+\\s+[^\\s]+\\s+([0-9]+)\\s+[^\\s]+\\s+[^\\s]+\\s+(.+)");
+    std::smatch matches;
+    if (std::regex_match(line, matches, re) && matches.size() == 4) {
+        std::string perms = matches[1].str();
+        uintmax_t size = std::stoull(matches[2].str());
+        std::string name = matches[3].str();
+        bool is_dir = (perms.front() == 'd');
+        return FtpEntry{name, is_dir, size, 0, {}};
+    }
+    return FtpEntry{line, false, 0, 0, {}};
+}
+
+static std::string make_synthetic_listing(size_t lines) {
+    std::string listing;
+    listing.reserve(lines * 64);
+    for (size_t i = 0; i < lines; ++i) {
+        if (i % 10 == 9) {
+            listing += "01-15-20  10:30AM       <DIR>          folder_" + std::to_string(i) + "\r\n";
+        } else if (i % 7 == 0) {
+            listing += "drwxr-xr-x    2 ftp      ftp          4096 Jan 01  2020 dir_" + std::to_string(i) + "\r\n";
+        } else {
+            listing += "-rw-r--r--    1 ftp      ftp      " + std::to_string(1000 + i * 37)
+                     + " Mar 12 10:45 file_" + std::to_string(i) + ".dat\r\n";
+        }
+    }
+    return listing;
+}
+
+template <typename Fn>
+static double measure_ms(Fn&& fn) {
+    auto started = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+}
+
+// Одна строка JSON на измерение, чтобы результаты можно было сравнивать между сборками.
+static void report(const std::string& bench, const std::string& variant, const std::string& params,
+                   double ms, double items, const char* unit) {
+    std::cout << "{\"bench\":\"" << bench << "\",\"variant\":\"" << variant << "\"";
+    if (!params.empty()) std::cout << "," << params;
+    std::cout << std::fixed << std::setprecision(3) << ",\"ms\":" << ms
+              << ",\"" << unit << "_per_sec\":" << (ms > 0 ? items * 1000.0 / ms : 0.0) << "}" << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+// Подавляет вывод клиента во время замеров.
+class QuietOutput {
+public:
+    QuietOutput() : saved_out(std::cout.rdbuf(sink.rdbuf())), saved_err(std::cerr.rdbuf(sink.rdbuf())) {}
+    ~QuietOutput() {
+        std::cout.rdbuf(saved_out);
+        std::cerr.rdbuf(saved_err);
+    }
+
+private:
+    std::ostringstream sink;
+    std::streambuf *saved_out;
+    std::streambuf *saved_err;
+};
+
+// Счетчики строк задаются в десятичных единицах: 1k = 1000, 1M = 1000000.
+static std::vector<size_t> parse_count_list(const std::string& text) {
+    std::vector<size_t> values;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        size_t value = 0;
+        auto [end, ec] = std::from_chars(item.data(), item.data() + item.size(), value);
+        if (ec != std::errc() || value == 0) continue;
+        std::string_view suffix(end, item.data() + item.size() - end);
+        if (suffix == "k" || suffix == "K") value *= 1000;
+        else if (suffix == "m" || suffix == "M") value *= 1000000;
+        else if (!suffix.empty()) continue;
+        values.push_back(value);
+    }
+    return values;
+}
+
+static void bench_listing_parse(size_t lines, size_t regex_max) {
+    std::string listing = make_synthetic_listing(lines);
+    std::string params = "\"lines\":" + std::to_string(lines);
+
+    if (lines <= regex_max) {
+        uintmax_t regex_total = 0;
+        double regex_ms = measure_ms([&] {
+            std::stringstream ss(listing);
+            std::string line;
+            while (std::getline(ss, line, '\n')) {
+                if (!line.empty()) regex_total += parse_ftp_entry_regex(line).size;
+            }
+        });
+        report("parse_list", "regex", params, regex_ms, (double)lines, "lines");
+    }
+
+    uintmax_t view_total = 0;
+    double view_ms = measure_ms([&] {
+        std::string_view rest(listing);
+        while (!rest.empty()) {
+            size_t eol = rest.find('\n');
+            std::string_view line = rest.substr(0, eol);
+            rest.remove_prefix(eol == std::string_view::npos ? rest.size() : eol + 1);
+            FtpEntryView entry;
+            if (parse_list_line(line, entry)) view_total += entry.size;
+        }
+    });
+    report("parse_list", "string_view", params, view_ms, (double)lines, "lines");
+
+    uintmax_t stream_total = 0;
+    double stream_ms = measure_ms([&] {
+        ListingStreamParser parser(false, [&](const FtpEntryView& entry) { stream_total += entry.size; });
+        const size_t chunk = CURL_MAX_WRITE_SIZE;
+        for (size_t offset = 0; offset < listing.size(); offset += chunk) {
+            parser.feed(listing.data() + offset, std::min(chunk, listing.size() - offset));
+        }
+        parser.finish();
+    });
+    report("parse_list", "stream", params, stream_ms, (double)lines, "lines");
+}
+
+static void bench_listing_sort(size_t entries, size_t top) {
+    ListingTable table;
+    table.reserve(entries);
+    for (size_t i = 0; i < entries; ++i) {
+        table.add("file_" + std::to_string(i * 2654435761u % entries) + ".dat", i % 50 == 0,
+                  (uintmax_t)(i * 2654435761u % 1000003), (time_t)(1600000000 + i % 86400));
+    }
+    std::string params = "\"entries\":" + std::to_string(entries) + ",\"top\":" + std::to_string(top);
+    size_t checksum = 0;
+    double top_ms = measure_ms([&] { checksum += table.order(ListingSort::size, top).size(); });
+    report("listing_sort", "size_top_n", params, top_ms, (double)entries, "entries");
+    double full_ms = measure_ms([&] { checksum += table.order(ListingSort::size, 0).size(); });
+    report("listing_sort", "size_full", params, full_ms, (double)entries, "entries");
+    double name_ms = measure_ms([&] { checksum += table.order(ListingSort::name, 0).size(); });
+    report("listing_sort", "name_full", params, name_ms, (double)entries, "entries");
+}
+
+static void bench_format_size(size_t iterations) {
+    size_t total_length = 0;
+    double ms = measure_ms([&] {
+        for (size_t i = 0; i < iterations; ++i) total_length += format_size_human((uintmax_t)i * 7919u).size();
+    });
+    report("format_size_human", "default", "\"iterations\":" + std::to_string(iterations), ms, (double)iterations, "calls");
+}
+
+static void bench_command_parse(size_t lines) {
+    static const char* const samples[] = { "get \"file with space.txt\" local.txt", "put data_001.csv data_001.csv", "mkdir logs/2020",
+                                           "cd ..", "mget -j 8 -S *.log", "# comment line", "rm old\\ file.bin 0" };
+    std::vector<std::string> script;
+    script.reserve(lines);
+    for (size_t i = 0; i < lines; ++i) script.push_back(samples[i % std::size(samples)]);
+    std::string params = "\"lines\":" + std::to_string(lines);
+
+    size_t stream_found = 0;
+    double stream_ms = measure_ms([&] {
+        for (const auto& line : script) {
+            std::stringstream ss(line);
+            std::string item;
+            std::vector<std::string> parts;
+            while (ss >> item) parts.push_back(item);
+            if (parts.empty()) continue;
+            std::transform(parts[0].begin(), parts[0].end(), parts[0].begin(), ::tolower);
+            stream_found += parts[0] == "get" || parts[0] == "put" || parts[0] == "mkdir" || parts[0] == "cd" || parts[0] == "mget" || parts[0] == "rm";
+        }
+    });
+    report("command_parse", "stringstream", params, stream_ms, (double)lines, "lines");
+
+    size_t table_found = 0;
+    CommandLine parser;
+    std::vector<std::string> args;
+    double table_ms = measure_ms([&] {
+        for (const auto& line : script) {
+            if (!parser.parse(line) || parser.empty()) continue;
+            parser.to_args(args);
+            table_found += find_command(args[0]) != nullptr;
+        }
+    });
+    report("command_parse", "command_table", params, table_ms, (double)lines, "lines");
+}
+
+static void bench_local_listing(const fs::path& work_dir, size_t files) {
+    fs::path tree = work_dir / ("tree_" + std::to_string(files));
+    fs::create_directories(tree);
+    for (size_t i = 0; i < files; ++i) {
+        if (i % 20 == 0) {
+            fs::create_directories(tree / ("dir_" + std::to_string(i)));
+        } else {
+            std::ofstream(tree / ("file_" + std::to_string(i) + ".dat")) << i;
+        }
+    }
+
+    fs::path previous = fs::current_path();
+    fs::current_path(tree);
+    LocalFileManager manager;
+    double serial_ms, parallel_ms;
+    {
+        QuietOutput quiet;
+        serial_ms = measure_ms([&] { manager.list_directory(); });
+        parallel_ms = measure_ms([&] { manager.list_directory(8); });
+    }
+    fs::current_path(previous);
+    report("local_list", "list_directory", "\"entries\":" + std::to_string(files), serial_ms, (double)files, "entries");
+    report("local_list", "list_directory_statx8", "\"entries\":" + std::to_string(files), parallel_ms, (double)files, "entries");
+}
+
+static void bench_transfers(const fs::path& work_dir, const std::string& url, const std::string& userpass,
+                            size_t file_size, size_t count, size_t concurrency) {
+    fs::path transfer_dir = work_dir / "transfer";
+    fs::create_directories(transfer_dir);
+    fs::path previous = fs::current_path();
+    fs::current_path(transfer_dir);
+
+    std::string chunk(1 << 20, '\0');
+    for (size_t i = 0; i < chunk.size(); ++i) chunk[i] = (char)(i * 131 + 7);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; ++i) {
+        names.push_back("ftp_bench_" + std::to_string(getpid()) + "_" + std::to_string(i) + ".bin");
+        std::ofstream out(names.back(), std::ios::binary);
+        for (size_t written = 0; written < file_size; written += chunk.size()) {
+            out.write(chunk.data(), (std::streamsize)std::min(chunk.size(), file_size - written));
+        }
+    }
+
+    std::string params = "\"file_size\":" + std::to_string(file_size) + ",\"files\":" + std::to_string(count)
+                       + ",\"concurrency\":" + std::to_string(concurrency);
+    double bytes = (double)file_size * (double)count;
+    FtpClient client;
+    bool uploaded = false, downloaded = false;
+    double put_ms = 0, get_ms = 0;
+    {
+        QuietOutput quiet;
+        client.connect(url, userpass);
+        put_ms = measure_ms([&] { uploaded = client.upload_batch(names, concurrency); });
+        for (const auto& name : names) fs::remove(name);
+        get_ms = measure_ms([&] { downloaded = client.download_batch(names, concurrency); });
+        for (const auto& name : names) client.delete_remote_path(name, false);
+    }
+    if (uploaded) report("transfer", "put", params, put_ms, bytes, "bytes");
+    else std::cerr << "put: передача не удалась" << std::endl;
+    if (downloaded) report("transfer", "get", params, get_ms, bytes, "bytes");
+    else std::cerr << "get: передача не удалась" << std::endl;
+
+    fs::current_path(previous);
+}
+
+static void print_usage() {
+    std::cerr << "Использование: ftp_bench [--lines 1k,100k,1M] [--regex-max N] [--local-files N] [--format-iterations N]\n"
+              << "                 [--url ftp://host/dir/ [--user user:password] [--size 16M] [--files N] [--concurrency N]]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<size_t> line_counts = { 1000, 100000, 1000000 };
+    size_t regex_max = 10000;
+    size_t local_files = 20000;
+    size_t format_iterations = 1000000;
+    std::string url, userpass;
+    size_t file_size = 16 << 20, files = 4, concurrency = 4;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) { print_usage(); return 1; }
+        std::string value = argv[++i];
+        uintmax_t number = 0;
+        if (arg == "--lines") { line_counts = parse_count_list(value); continue; }
+        if (arg == "--url") { url = value; continue; }
+        if (arg == "--user") { userpass = value; continue; }
+        if (!parse_size_value(value, number)) { print_usage(); return 1; }
+        if (arg == "--regex-max") regex_max = (size_t)number;
+        else if (arg == "--local-files") local_files = (size_t)number;
+        else if (arg == "--format-iterations") format_iterations = (size_t)number;
+        else if (arg == "--size") file_size = (size_t)number;
+        else if (arg == "--files") files = std::max<size_t>((size_t)number, 1);
+        else if (arg == "--concurrency") concurrency = std::max<size_t>((size_t)number, 1);
+        else { print_usage(); return 1; }
+    }
+
+    fs::path work_dir = fs::temp_directory_path() / ("ftp_bench_" + std::to_string(getpid()));
+    fs::create_directories(work_dir);
+
+    for (size_t lines : line_counts) bench_listing_parse(lines, regex_max);
+    for (size_t lines : line_counts) bench_listing_sort(lines, 10);
+    if (format_iterations > 0) bench_format_size(format_iterations);
+    for (size_t lines : line_counts) bench_command_parse(lines);
+    if (local_files > 0) bench_local_listing(work_dir, local_files);
+    if (!url.empty()) bench_transfers(work_dir, url, userpass, file_size, files, concurrency);
+
+    std::error_code ec;
+    fs::remove_all(work_dir, ec);
+    return 0;
+}
@@ -2,12 +2,38 @@
 #include <string>
 #include <vector>
 #include <curl/curl.h>
+#include <zlib.h>
+#include <openssl/evp.h>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <filesystem>
 #include <iomanip>
-#include <regex>
+#include <string_view>
+#include <charconv>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <bitset>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <ctime>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
 
 namespace fs = std::filesystem;
 
@@ -35,309 +61,4813 @@ static size_t write_string_callback(void *contents, size_t size, size_t nmemb, v
     return size * nmemb;
 }
 
-struct FtpFile {
-    const char *filename;
-    FILE *stream;
-};
+enum class HashAlgorithm { crc32, md5, sha1, sha256 };
 
-static size_t write_file_callback(void *buffer, size_t size, size_t nmemb, void *stream) {
-    struct FtpFile *out = (struct FtpFile *)stream;
-    if (!out->stream) {
-        out->stream = fopen(out->filename, "wb");
-        if (!out->stream) return -1;
+// Контрольная сумма считается по ходу передачи, без второго чтения файла. EVP выбирает
+// аппаратную реализацию SHA/MD5 сама, crc32_z из zlib использует векторный путь, если он собран.
+class StreamHasher {
+public:
+    explicit StreamHasher(HashAlgorithm algorithm) : algorithm(algorithm) {
+        if (algorithm == HashAlgorithm::crc32) return;
+        const EVP_MD *md = algorithm == HashAlgorithm::sha256 ? EVP_sha256()
+                         : algorithm == HashAlgorithm::sha1 ? EVP_sha1() : EVP_md5();
+        context = EVP_MD_CTX_new();
+        if (!context || EVP_DigestInit_ex(context, md, nullptr) != 1) ok = false;
     }
-    return fwrite(buffer, size, nmemb, out->stream);
-}
 
-static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *stream) {
-    FILE *file = (FILE *)stream;
-    size_t nread = fread(ptr, size, nmemb, file);
-    return nread;
-}
+    StreamHasher(const StreamHasher&) = delete;
+    StreamHasher& operator=(const StreamHasher&) = delete;
+    ~StreamHasher() { EVP_MD_CTX_free(context); }
 
-class LocalFileManager {
-private:
-    struct FileEntry {
-        std::string name;
-        bool is_directory;
-        uintmax_t size;
-    };
+    static const char* name(HashAlgorithm algorithm) {
+        switch (algorithm) {
+            case HashAlgorithm::crc32: return "CRC32";
+            case HashAlgorithm::md5: return "MD5";
+            case HashAlgorithm::sha1: return "SHA-1";
+            default: return "SHA-256";
+        }
+    }
+
+    HashAlgorithm kind() const { return algorithm; }
 
-    static bool compareFiles(const FileEntry& a, const FileEntry& b) {
-        if (a.is_directory != b.is_directory) {
-            return a.is_directory > b.is_directory;
+    void update(const void *data, size_t length) {
+        if (algorithm == HashAlgorithm::crc32) crc = crc32_z(crc, (const Bytef *)data, length);
+        else if (ok && EVP_DigestUpdate(context, data, length) != 1) ok = false;
+    }
+
+    // Для докачки: уже имеющийся префикс файла хэшируется до начала передачи.
+    bool update_from_file(const std::string& path, uintmax_t length) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> chunk(1 << 20);
+        while (in && length > 0) {
+            in.read(chunk.data(), (std::streamsize)std::min<uintmax_t>(chunk.size(), length));
+            update(chunk.data(), (size_t)in.gcount());
+            length -= (uintmax_t)in.gcount();
         }
-        return a.name < b.name;
+        return length == 0;
     }
 
-public:
-    void list_directory() {
-        try {
-            std::vector<FileEntry> entries;
-            for (const auto& entry : fs::directory_iterator(fs::current_path())) {
-                entries.push_back({
-                    entry.path().filename().string(),
-                    fs::is_directory(entry.path()),
-                    fs::is_regular_file(entry.path()) ? fs::file_size(entry.path()) : 0
-                });
+    const std::string& digest() {
+        if (!finished) {
+            finished = true;
+            unsigned char bytes[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+            if (algorithm == HashAlgorithm::crc32) {
+                for (int shift = 24; shift >= 0; shift -= 8) bytes[length++] = (unsigned char)(crc >> shift);
+            } else if (!ok || EVP_DigestFinal_ex(context, bytes, &length) != 1) {
+                length = 0;
             }
-            std::sort(entries.begin(), entries.end(), compareFiles);
+            result.assign((const char *)bytes, length);
+        }
+        return result;
+    }
 
-            std::cout << "\n--- Локальная директория " << fs::current_path() << " ---" << std::endl;
-            std::cout << std::left << std::setw(6) << "Тип" 
-                      << std::left << std::setw(40) << "Имя" 
-                      << std::right << std::setw(15) << "Размер" << std::endl;
-            std::cout << std::string(61, '-') << std::endl;
+    std::string hex() {
+        static const char digits[] = "0123456789abcdef";
+        std::string text;
+        for (unsigned char c : digest()) {
+            text += digits[c >> 4];
+            text += digits[c & 15];
+        }
+        return text;
+    }
 
-            for (const auto& entry : entries) {
-                std::string type_str = entry.is_directory ? "DIR" : "FILE";
-                std::string color = entry.is_directory ? COLOR_DIR : COLOR_FILE;
+private:
+    HashAlgorithm algorithm;
+    EVP_MD_CTX *context = nullptr;
+    uLong crc = 0;
+    bool ok = true;
+    bool finished = false;
+    std::string result;
+};
 
-                std::cout << color << std::left << std::setw(6) << type_str
-                          << std::left << std::setw(40) << entry.name << COLOR_RESET;
-                if (!entry.is_directory) {
-                    std::string size_str = format_size_human(entry.size);
-                    std::cout << COLOR_SIZE << std::right << std::setw(15) << size_str << COLOR_RESET;
-                } else {
-                    std::cout << std::right << std::setw(15) << "-";
-                }
-                std::cout << std::endl;
-            }
-            std::cout << "-----------------------------------------------------------------" << std::endl;
-        } catch (const fs::filesystem_error& e) {
-            std::cerr << "Ошибка листинга локальной директории: " << e.what() << std::endl;
+struct DownloadOptions {
+    size_t buffer_size = 4 * 1024 * 1024;
+    bool direct_io = false;
+    bool drop_cache = false;
+};
+
+class DownloadSink {
+public:
+    static constexpr size_t alignment = 4096;
+
+    static std::string partial_path(const std::string& final_path) { return final_path + ".part"; }
+
+    DownloadSink(std::string final_path, curl_off_t resume_from, const DownloadOptions& options, CURL *handle)
+        : final_path(std::move(final_path)), resume_from(resume_from), options(options), handle(handle) {}
+
+    DownloadSink(const DownloadSink&) = delete;
+    DownloadSink& operator=(const DownloadSink&) = delete;
+
+    ~DownloadSink() {
+        if (fd >= 0) ::close(fd);
+        free(buffer);
+    }
+
+    size_t write(const char *data, size_t length) {
+        if (failed || !ensure_open(handle)) return 0;
+        if (hasher) hasher->update(data, length);
+        size_t total = length;
+        while (length > 0) {
+            size_t n = std::min(capacity - used, length);
+            memcpy(buffer + used, data, n);
+            used += n;
+            data += n;
+            length -= n;
+            if (used == capacity && !flush()) return 0;
         }
+        return total;
     }
 
-    void change_directory(const std::string& path_str) {
-        fs::path p(path_str);
+    // Может вызываться из другого потока после передачи: дескриптор уже не трогается,
+    // пустой файл открывается без запроса размера.
+    bool commit() {
+        if (!ensure_open(nullptr) || !flush()) return false;
+        ::close(fd);
+        fd = -1;
+        complete = true;
         std::error_code ec;
-        fs::current_path(p, ec);
+        fs::rename(partial_path(final_path), final_path, ec);
         if (ec) {
-            std::cerr << "Ошибка смены локальной директории: " << ec.message() << std::endl;
-        } else {
-            std::cout << "Локальная директория изменена на: " << fs::current_path() << std::endl;
+            std::cerr << "Не удалось переименовать '" << partial_path(final_path) << "': " << ec.message() << std::endl;
+            return false;
         }
+        return true;
     }
 
-    void create_directory(const std::string& path_str) {
-        std::error_code ec;
-        if (fs::create_directory(path_str, ec)) {
-            std::cout << "Локальная директория '" << path_str << "' создана." << std::endl;
-        } else if (ec.value() != 0 && ec.value() != EEXIST) {
-            std::cerr << "Ошибка создания локальной директории: " << ec.message() << std::endl;
-        } else {
-             std::cout << "Локальная директория '" << path_str << "' уже существует или произошла иная ошибка." << std::endl;
+    // После неудачного переименования в commit() .part уже полон и сохраняется целиком.
+    bool abort(bool keep_partial) {
+        bool kept = keep_partial && complete;
+        if (fd >= 0) {
+            if (keep_partial) flush();
+            ::close(fd);
+            fd = -1;
+            kept = keep_partial && file_offset > 0;
+        }
+        if (!kept && opened) {
+            std::error_code ec;
+            fs::remove(partial_path(final_path), ec);
         }
+        return kept;
     }
 
-    void remove_path(const std::string& path_str) {
-        std::error_code ec;
-        if (fs::remove(path_str, ec)) {
-            std::cout << "Файл/директория '" << path_str << "' удален(а)." << std::endl;
-        } else {
-            std::cerr << "Ошибка удаления '" << path_str << "': " << ec.message() << std::endl;
+    curl_off_t bytes_written() const { return file_offset + (curl_off_t)used - resume_from; }
+
+    void set_hasher(StreamHasher *stream_hasher) { hasher = stream_hasher; }
+
+private:
+    std::string final_path;
+    curl_off_t resume_from;
+    DownloadOptions options;
+    CURL *handle;
+    StreamHasher *hasher = nullptr;
+    int fd = -1;
+    bool opened = false;
+    bool failed = false;
+    bool complete = false;
+    bool direct = false;
+    char *buffer = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    curl_off_t file_offset = 0;
+
+    // size_source - дескриптор передачи, из которого берется ожидаемый размер для fallocate.
+    bool ensure_open(CURL *size_source) {
+        if (opened) return !failed;
+        opened = true;
+        std::string temp_path = partial_path(final_path);
+        int flags = O_WRONLY | O_CREAT | (resume_from > 0 ? 0 : O_TRUNC);
+#ifdef O_DIRECT
+        direct = options.direct_io && resume_from % (curl_off_t)alignment == 0;
+        if (direct) fd = ::open(temp_path.c_str(), flags | O_DIRECT, 0644);
+#endif
+        if (fd < 0) {
+            direct = false;
+            fd = ::open(temp_path.c_str(), flags, 0644);
         }
+        if (fd < 0) {
+            std::cerr << "Не удалось открыть локальный файл '" << temp_path << "': " << strerror(errno) << std::endl;
+            failed = true;
+            return false;
+        }
+        file_offset = resume_from;
+
+        curl_off_t expected = -1;
+        if (size_source) curl_easy_getinfo(size_source, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &expected);
+#ifdef __linux__
+        if (expected > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, resume_from, expected);
+#endif
+        capacity = std::max(options.buffer_size, alignment);
+        capacity = (capacity + alignment - 1) / alignment * alignment;
+        if (expected > 0) {
+            size_t needed = ((size_t)expected + alignment - 1) / alignment * alignment;
+            capacity = std::min(capacity, needed);
+        }
+        void *memory = nullptr;
+        if (posix_memalign(&memory, alignment, capacity) != 0) {
+            std::cerr << "Не удалось выделить буфер записи" << std::endl;
+            failed = true;
+            return false;
+        }
+        buffer = (char *)memory;
+        return true;
     }
 
-    void move_path(const std::string& from_str, const std::string& to_str) {
+    bool flush() {
+        if (used == 0) return true;
+#ifdef O_DIRECT
+        if (direct && used % alignment != 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            direct = false;
+        }
+#endif
+        size_t written = 0;
+        while (written < used) {
+            ssize_t n = pwrite(fd, buffer + written, used - written, file_offset + (off_t)written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "Ошибка записи '" << partial_path(final_path) << "': " << strerror(errno) << std::endl;
+                failed = true;
+                return false;
+            }
+            written += (size_t)n;
+        }
+#ifdef __linux__
+        if (options.drop_cache && !direct) {
+            sync_file_range(fd, file_offset, used, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, file_offset, used, POSIX_FADV_DONTNEED);
+        }
+#endif
+        file_offset += (curl_off_t)used;
+        used = 0;
+        return true;
+    }
+};
+
+static size_t write_file_callback(void *buffer, size_t size, size_t nmemb, void *userp) {
+    return ((DownloadSink *)userp)->write((const char *)buffer, size * nmemb);
+}
+
+struct TransferJournal {
+    std::string direction;
+    std::string url;
+    curl_off_t total = -1;
+
+    static std::string path_for(const std::string& local_file) { return local_file + ".ftpjournal"; }
+
+    static bool load(const std::string& local_file, TransferJournal& journal) {
+        std::ifstream in(path_for(local_file));
+        if (!in) return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            std::string key = line.substr(0, eq);
+            std::string value = line.substr(eq + 1);
+            if (key == "direction") journal.direction = value;
+            else if (key == "url") journal.url = value;
+            else if (key == "total") {
+                try { journal.total = std::stoll(value); } catch (const std::exception&) { journal.total = -1; }
+            }
+        }
+        return !journal.direction.empty() && !journal.url.empty();
+    }
+
+    bool save(const std::string& local_file) const {
+        std::ofstream out(path_for(local_file), std::ios::trunc);
+        out << "direction=" << direction << "\n"
+            << "url=" << url << "\n"
+            << "total=" << total << "\n";
+        return static_cast<bool>(out);
+    }
+
+    static void remove(const std::string& local_file) {
         std::error_code ec;
-        fs::rename(from_str, to_str, ec);
-        if (ec) {
-            std::cerr << "Ошибка перемещения/переименования: " << ec.message() << std::endl;
-        } else {
-            std::cout << "Перемещено/переименовано из '" << from_str << "' в '" << to_str << "'" << std::endl;
+        fs::remove(path_for(local_file), ec);
+    }
+};
+
+static bool parse_size_value(const std::string& text, uintmax_t& bytes) {
+    if (text.empty()) return false;
+    size_t digits = 0;
+    while (digits < text.size() && isdigit(static_cast<unsigned char>(text[digits]))) ++digits;
+    if (digits == 0) return false;
+    uintmax_t value = std::stoull(text.substr(0, digits));
+    std::string suffix = text.substr(digits);
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+    if (suffix == "" || suffix == "B") bytes = value;
+    else if (suffix == "K" || suffix == "KB") bytes = value << 10;
+    else if (suffix == "M" || suffix == "MB") bytes = value << 20;
+    else if (suffix == "G" || suffix == "GB") bytes = value << 30;
+    else return false;
+    return true;
+}
+
+struct SegmentSink {
+    int fd;
+    curl_off_t offset;
+    curl_off_t end;
+};
+
+static size_t write_segment_callback(void *buffer, size_t size, size_t nmemb, void *userp) {
+    struct SegmentSink *sink = (struct SegmentSink *)userp;
+    size_t total = size * nmemb;
+    size_t to_write = total;
+    if (sink->offset + (curl_off_t)to_write > sink->end) {
+        to_write = sink->offset < sink->end ? (size_t)(sink->end - sink->offset) : 0;
+    }
+    const char *data = (const char *)buffer;
+    size_t written = 0;
+    while (written < to_write) {
+        ssize_t n = pwrite(sink->fd, data + written, to_write - written, sink->offset + written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        written += (size_t)n;
+    }
+    sink->offset += written;
+    return total;
+}
+
+struct UploadSource {
+    FILE *stream = NULL;
+    int fd = -1;
+    const char *mapping = nullptr;
+    size_t length = 0;
+    size_t offset = 0;
+    StreamHasher *hasher = nullptr;
+
+    UploadSource() = default;
+    UploadSource(const UploadSource&) = delete;
+    UploadSource& operator=(const UploadSource&) = delete;
+    ~UploadSource() { close(); }
+
+    bool open(const std::string& path, curl_off_t start, bool use_mmap) {
+        close();
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || start > st.st_size) {
+            close();
+            return false;
+        }
+        length = (size_t)st.st_size;
+        offset = (size_t)start;
+        if (use_mmap && S_ISREG(st.st_mode) && length > 0) {
+            void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                mapping = (const char *)mapped;
+                madvise(mapped, length, MADV_SEQUENTIAL);
+                return true;
+            }
         }
+        stream = fdopen(fd, "rb");
+        if (!stream) {
+            close();
+            return false;
+        }
+        fd = -1;
+        if (offset > 0 && fseeko(stream, (off_t)offset, SEEK_SET) != 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    curl_off_t remaining() const { return (curl_off_t)(length - offset); }
+
+    void close() {
+        if (mapping) munmap((void *)mapping, length);
+        if (stream) fclose(stream);
+        if (fd >= 0) ::close(fd);
+        mapping = nullptr;
+        stream = NULL;
+        fd = -1;
+        length = 0;
+        offset = 0;
     }
 };
 
+static size_t read_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
+    UploadSource *source = (UploadSource *)userp;
+    size_t n;
+    if (!source->mapping) {
+        n = fread(ptr, 1, size * nmemb, source->stream);
+    } else {
+        n = std::min(size * nmemb, source->length - source->offset);
+        memcpy(ptr, source->mapping + source->offset, n);
+        source->offset += n;
+    }
+    if (source->hasher) source->hasher->update(ptr, n);
+    return n;
+}
+
+// MODE Z: содержимое канала данных передается одним потоком zlib (RFC 1950).
+class InflateSink {
+public:
+    explicit InflateSink(DownloadSink& sink) : sink(sink), output(64 * 1024) {
+        memset(&stream, 0, sizeof(stream));
+        ok = inflateInit(&stream) == Z_OK;
+    }
+
+    InflateSink(const InflateSink&) = delete;
+    InflateSink& operator=(const InflateSink&) = delete;
+    ~InflateSink() { inflateEnd(&stream); }
+
+    size_t write(const char *data, size_t length) {
+        if (!ok) return 0;
+        if (ended) return length;
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = (uInt)length;
+        do {
+            stream.next_out = output.data();
+            stream.avail_out = (uInt)output.size();
+            int rc = inflate(&stream, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                std::cerr << "Ошибка распаковки MODE Z: " << (stream.msg ? stream.msg : zError(rc)) << std::endl;
+                ok = false;
+                return 0;
+            }
+            size_t produced = output.size() - stream.avail_out;
+            if (produced > 0 && sink.write((const char *)output.data(), produced) != produced) {
+                ok = false;
+                return 0;
+            }
+            if (rc == Z_STREAM_END) ended = true;
+            if (rc == Z_BUF_ERROR && produced == 0) break;
+        } while (!ended && (stream.avail_in > 0 || stream.avail_out == 0));
+        return length;
+    }
+
+    // Пустой файл сервер может передать вообще без данных.
+    bool finish() const { return ok && (ended || stream.total_in == 0); }
 
-class FtpClient {
 private:
-    CURL *curl; std::string base_url; std::string user_password;
+    DownloadSink& sink;
+    std::vector<Bytef> output;
+    z_stream stream;
+    bool ok = false;
+    bool ended = false;
+};
 
-    std::string ensure_trailing_slash(std::string url) { if (url.back() != '/') url += '/'; return url; }
+static size_t write_inflate_callback(void *buffer, size_t size, size_t nmemb, void *userp) {
+    return ((InflateSink *)userp)->write((const char *)buffer, size * nmemb);
+}
+
+class DeflateSource {
+public:
+    DeflateSource(UploadSource& source, int level) : source(source), input(64 * 1024) {
+        memset(&stream, 0, sizeof(stream));
+        ok = deflateInit(&stream, level) == Z_OK;
+    }
+
+    DeflateSource(const DeflateSource&) = delete;
+    DeflateSource& operator=(const DeflateSource&) = delete;
+    ~DeflateSource() { deflateEnd(&stream); }
+
+    size_t read(char *buffer, size_t size) {
+        if (!ok) return CURL_READFUNC_ABORT;
+        stream.next_out = (Bytef *)buffer;
+        stream.avail_out = (uInt)size;
+        while (stream.avail_out == size && !finished) {
+            if (stream.avail_in == 0 && !eof) {
+                size_t n = read_callback(input.data(), 1, input.size(), &source);
+                eof = n == 0;
+                stream.next_in = input.data();
+                stream.avail_in = (uInt)n;
+            }
+            int rc = deflate(&stream, eof ? Z_FINISH : Z_NO_FLUSH);
+            if (rc == Z_STREAM_END) {
+                finished = true;
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                ok = false;
+                return CURL_READFUNC_ABORT;
+            }
+        }
+        return size - stream.avail_out;
+    }
+
+private:
+    UploadSource& source;
+    std::vector<Bytef> input;
+    z_stream stream;
+    bool ok = false;
+    bool eof = false;
+    bool finished = false;
+};
+
+static size_t read_deflate_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
+    return ((DeflateSource *)userp)->read((char *)ptr, size * nmemb);
+}
+
+// Архив tar (ustar) из набора локальных файлов, собираемый по мере чтения для одной команды STOR:
+// временный файл не создается. Длина архива известна заранее (INFILESIZE), поэтому файл,
+// изменившийся после add(), дополняется нулями или обрезается до исходного размера, как в
+// GNU tar. Имена длиннее 100 байт делятся на prefix/name, иначе пишутся записью GNU LongLink.
+class TarSource {
+public:
+    static constexpr size_t block = 512;
+
+    StreamHasher *hasher = nullptr;
+
+    TarSource() = default;
+    TarSource(const TarSource&) = delete;
+    TarSource& operator=(const TarSource&) = delete;
+    ~TarSource() { close_member(); }
+
+    bool add(const std::string& path, const std::string& name) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || name.empty()) return false;
+        members.push_back({ path, name, (uintmax_t)st.st_size, st.st_mtime, st.st_mode & 07777 });
+        return true;
+    }
+
+    size_t count() const { return members.size(); }
+
+    curl_off_t total_size() const {
+        uintmax_t total = 2 * block;
+        for (const auto& member : members) total += header_for(member).size() + padded(member.size);
+        return (curl_off_t)total;
+    }
 
-    struct FtpEntry {
+    // Файлы, которые при чтении оказались короче или длиннее, чем при add().
+    const std::vector<std::string>& changed() const { return changed_paths; }
+    const std::string& unreadable() const { return unreadable_path; }
+
+    size_t read(char *out, size_t length) {
+        size_t produced = 0;
+        while (produced < length) {
+            size_t room = length - produced;
+            if (header_offset < header.size()) {
+                size_t n = std::min(room, header.size() - header_offset);
+                memcpy(out + produced, header.data() + header_offset, n);
+                header_offset += n;
+                produced += n;
+            } else if (remaining > 0) {
+                size_t want = (size_t)std::min<uintmax_t>(room, remaining);
+                ssize_t n = ::read(fd, out + produced, want);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    if (n < 0) {
+                        unreadable_path = members[next - 1].path;
+                        return CURL_READFUNC_ABORT;
+                    }
+                    // Файл укоротился: недостающая часть заполняется нулями.
+                    note_changed();
+                    memset(out + produced, 0, want);
+                    n = (ssize_t)want;
+                }
+                remaining -= (uintmax_t)n;
+                produced += (size_t)n;
+                if (remaining == 0 && fd >= 0) {
+                    char probe;
+                    if (::read(fd, &probe, 1) > 0) note_changed();
+                    close_member();
+                }
+            } else if (padding > 0) {
+                size_t n = std::min(room, padding);
+                memset(out + produced, 0, n);
+                padding -= n;
+                produced += n;
+            } else if (!start_next()) {
+                if (!unreadable_path.empty()) return CURL_READFUNC_ABORT;
+                break;
+            }
+        }
+        if (hasher) hasher->update(out, produced);
+        return produced;
+    }
+
+private:
+    struct Member {
+        std::string path;
         std::string name;
-        bool is_directory;
         uintmax_t size;
+        time_t mtime;
+        mode_t mode;
     };
 
-    static FtpEntry parse_ftp_entry(const std::string& line) {
-        std::regex re("([drwx\\-]+)\\s+\\d+\\s+[^\\s]+\\s+[^\\s]+\\s+([0-9]+)\\s+[^\\s]+\\s+[^\\s]+\\s+(.+)");
-        std::smatch matches;
-        if (std::regex_match(line, matches, re) && matches.size() == 4) {
-            std::string perms = matches[1].str();
-            uintmax_t size = std::stoull(matches[2].str());
-            std::string name = matches[3].str();
-            bool is_dir = (perms.front() == 'd');
-            return {name, is_dir, size};
+    std::vector<Member> members;
+    size_t next = 0;
+    bool trailer_written = false;
+    std::string header;
+    size_t header_offset = 0;
+    int fd = -1;
+    uintmax_t remaining = 0;
+    size_t padding = 0;
+    bool member_changed = false;
+    std::vector<std::string> changed_paths;
+    std::string unreadable_path;
+
+    static uintmax_t padded(uintmax_t size) { return (size + block - 1) / block * block; }
+
+    // Восьмеричное число с завершающим нулем; не помещающееся в поле пишется в base-256 (GNU).
+    static void put_number(char *field, size_t width, uintmax_t value) {
+        if (value < ((uintmax_t)1 << (3 * (width - 1)))) {
+            field[width - 1] = '\0';
+            for (size_t i = width - 1; i-- > 0; value >>= 3) field[i] = (char)('0' + (value & 7));
+            return;
         }
-        return {line, false, 0};
+        for (size_t i = width; i-- > 1; value >>= 8) field[i] = (char)(value & 0xff);
+        field[0] = (char)0x80;
     }
 
-    CURLcode perform_curl_operation(const std::string& url, void* write_data_ptr, size_t (*write_func)(void*, size_t, size_t, void*), long upload_mode = 0L, void* read_data_ptr = nullptr, size_t (*read_func)(void*, size_t, size_t, void*) = nullptr) {
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_data_ptr);
-        curl_easy_setopt(curl, CURLOPT_UPLOAD, upload_mode);
-        if (upload_mode) {
-            curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_func);
-            curl_easy_setopt(curl, CURLOPT_READDATA, read_data_ptr);
+    static std::string make_block(const std::string& name, const std::string& prefix, char type, uintmax_t size, time_t mtime, mode_t mode) {
+        std::string result(block, '\0');
+        char *h = &result[0];
+        memcpy(h, name.data(), std::min<size_t>(name.size(), 100));
+        put_number(h + 100, 8, mode);
+        put_number(h + 108, 8, 0);
+        put_number(h + 116, 8, 0);
+        put_number(h + 124, 12, size);
+        put_number(h + 136, 12, mtime > 0 ? (uintmax_t)mtime : 0);
+        h[156] = type;
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+        memcpy(h + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+        memset(h + 148, ' ', 8);
+        unsigned sum = 0;
+        for (size_t i = 0; i < block; ++i) sum += (unsigned char)h[i];
+        snprintf(h + 148, 8, "%06o", sum);
+        h[155] = ' ';
+        return result;
+    }
+
+    static std::string header_for(const Member& member) {
+        const std::string& name = member.name;
+        if (name.size() <= 100) return make_block(name, "", '0', member.size, member.mtime, member.mode);
+        for (size_t slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+            if (slash > 155) break;
+            if (name.size() - slash - 1 <= 100 && slash + 1 < name.size()) {
+                return make_block(name.substr(slash + 1), name.substr(0, slash), '0', member.size, member.mtime, member.mode);
+            }
         }
-        CURLcode res = curl_easy_perform(curl);
-        if (upload_mode) {
-            curl_easy_setopt(curl, CURLOPT_UPLOAD, 0L);
+        std::string result = make_block("././@LongLink", "", 'L', name.size() + 1, 0, 0644);
+        result += name;
+        result.append((size_t)(padded(name.size() + 1) - name.size()), '\0');
+        return result + make_block(name.substr(0, 100), "", '0', member.size, member.mtime, member.mode);
+    }
+
+    bool start_next() {
+        if (next == members.size()) {
+            if (trailer_written) return false;
+            header.assign(2 * block, '\0');
+            header_offset = 0;
+            trailer_written = true;
+            return true;
         }
-        return res;
+        const Member& member = members[next++];
+        fd = ::open(member.path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            unreadable_path = member.path;
+            return false;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        header = header_for(member);
+        header_offset = 0;
+        remaining = member.size;
+        padding = (size_t)(padded(member.size) - member.size);
+        member_changed = false;
+        if (remaining == 0) {
+            char probe;
+            if (::read(fd, &probe, 1) > 0) note_changed();
+            close_member();
+        }
+        return true;
     }
 
-public:
-    FtpClient() : curl(nullptr) {
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-        curl = curl_easy_init();
-        if (!curl) { std::cerr << "Ошибка инициализации libcurl!" << std::endl; exit(1); }
-        curl_easy_setopt(curl, CURLOPT_FTP_SKIP_PASV_IP, 1L);
+    void note_changed() {
+        if (member_changed) return;
+        member_changed = true;
+        changed_paths.push_back(members[next - 1].path);
+    }
+
+    void close_member() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
     }
+};
 
-    ~FtpClient() { if (curl) curl_easy_cleanup(curl); curl_global_cleanup(); }
+static size_t read_tar_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
+    return ((TarSource *)userp)->read((char *)ptr, size * nmemb);
+}
 
-    void connect(const std::string& url, const std::string& userpass) { 
-        base_url = ensure_trailing_slash(url);
-        user_password = userpass;
-        if (!userpass.empty()) { curl_easy_setopt(curl, CURLOPT_USERPWD, userpass.c_str()); }
-        std::cout << "Установлен базовый URL: " << base_url << std::endl;
+// MODE Z включается перед RETR/STOR и выключается после; размер из ответа 150 относится
+// к несжатым данным, поэтому libcurl не должен сверять с ним число принятых байт.
+// Если передача оборвалась до POSTQUOTE, соединение в общем кэше остается в MODE Z,
+// поэтому после согласования сжатия каждая операция начинается с MODE S (reset).
+struct ModeZCommands {
+    struct curl_slist *before = curl_slist_append(nullptr, "MODE Z");
+    struct curl_slist *after = curl_slist_append(nullptr, "MODE S");
+    struct curl_slist *reset = curl_slist_append(nullptr, "MODE S");
+
+    ModeZCommands() = default;
+    ModeZCommands(const ModeZCommands&) = delete;
+    ModeZCommands& operator=(const ModeZCommands&) = delete;
+    ~ModeZCommands() {
+        curl_slist_free_all(before);
+        curl_slist_free_all(after);
+        curl_slist_free_all(reset);
+    }
+
+    void apply(CURL *handle) const {
+        curl_easy_setopt(handle, CURLOPT_PREQUOTE, before);
+        curl_easy_setopt(handle, CURLOPT_POSTQUOTE, after);
+        curl_easy_setopt(handle, CURLOPT_IGNORE_CONTENT_LENGTH, 1L);
+    }
+
+    static void clear(CURL *handle) {
+        curl_easy_setopt(handle, CURLOPT_PREQUOTE, nullptr);
+        curl_easy_setopt(handle, CURLOPT_POSTQUOTE, nullptr);
+        curl_easy_setopt(handle, CURLOPT_IGNORE_CONTENT_LENGTH, 0L);
+    }
+};
+
+struct FtpEntry {
+    std::string name;
+    bool is_directory;
+    uintmax_t size;
+    time_t mtime = 0;
+    std::string unique_id;
+};
+
+struct FtpEntryView {
+    std::string_view name;
+    bool is_directory;
+    uintmax_t size;
+    time_t mtime = 0;
+    std::string_view unique_id;
+
+    FtpEntry to_entry() const { return { std::string(name), is_directory, size, mtime, std::string(unique_id) }; }
+};
+
+static inline bool is_list_space(char c) { return c == ' ' || c == '\t'; }
+
+static std::string_view skip_list_spaces(std::string_view text) {
+    size_t i = 0;
+    while (i < text.size() && is_list_space(text[i])) ++i;
+    return text.substr(i);
+}
+
+static std::string_view next_list_token(std::string_view& rest) {
+    rest = skip_list_spaces(rest);
+    size_t end = 0;
+    while (end < rest.size() && !is_list_space(rest[end])) ++end;
+    std::string_view token = rest.substr(0, end);
+    rest.remove_prefix(end);
+    return token;
+}
+
+static bool parse_list_number(std::string_view token, uintmax_t& value) {
+    if (token.empty()) return false;
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+static int month_index(std::string_view token) {
+    static constexpr std::string_view months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    if (token.size() != 3) return -1;
+    for (int i = 0; i < 12; ++i) {
+        if (months[i] == token) return i;
+    }
+    return -1;
+}
+
+static bool parse_fixed_number(std::string_view text, size_t pos, size_t len, int& value) {
+    if (pos + len > text.size()) return false;
+    uintmax_t parsed = 0;
+    if (!parse_list_number(text.substr(pos, len), parsed)) return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+static time_t make_utc_time(int year, int month, int day, int hour, int minute, int second) {
+    struct tm tm_value = {};
+    tm_value.tm_year = year - 1900;
+    tm_value.tm_mon = month;
+    tm_value.tm_mday = day;
+    tm_value.tm_hour = hour;
+    tm_value.tm_min = minute;
+    tm_value.tm_sec = second;
+    return timegm(&tm_value);
+}
+
+// "Jan 01 12:00" (текущий год) или "Jan 01  2020"
+static time_t parse_unix_list_time(int month, std::string_view day_token, std::string_view time_or_year) {
+    uintmax_t day = 0;
+    if (!parse_list_number(day_token, day)) return 0;
+    int hour = 0, minute = 0, year = 0;
+    if (time_or_year.size() == 5 && time_or_year[2] == ':') {
+        if (!parse_fixed_number(time_or_year, 0, 2, hour) || !parse_fixed_number(time_or_year, 3, 2, minute)) return 0;
+        time_t now = time(nullptr);
+        struct tm now_tm;
+        gmtime_r(&now, &now_tm);
+        year = now_tm.tm_year + 1900;
+        time_t candidate = make_utc_time(year, month, (int)day, hour, minute, 0);
+        return candidate > now + 86400 ? make_utc_time(year - 1, month, (int)day, hour, minute, 0) : candidate;
+    }
+    if (!parse_fixed_number(time_or_year, 0, time_or_year.size(), year)) return 0;
+    return make_utc_time(year, month, (int)day, 0, 0, 0);
+}
+
+// drwxr-xr-x  2 owner group  4096 Jan 01 12:00 name (group может отсутствовать)
+static bool parse_unix_list_line(std::string_view line, FtpEntryView& entry) {
+    std::string_view rest = line;
+    std::string_view perms = next_list_token(rest);
+    if (perms.size() < 10) return false;
+    char type = perms[0];
+    if (type != 'd' && type != '-' && type != 'l' && type != 'b' && type != 'c' && type != 'p' && type != 's') return false;
+
+    std::string_view previous;
+    uintmax_t size = 0;
+    int month = -1;
+    for (int fields = 0;; ++fields) {
+        std::string_view token = next_list_token(rest);
+        if (token.empty() || fields > 5) return false;
+        month = month_index(token);
+        if (month >= 0 && parse_list_number(previous, size)) break;
+        previous = token;
+    }
+    std::string_view day = next_list_token(rest);
+    std::string_view time_or_year = next_list_token(rest);
+    if (day.empty() || time_or_year.empty()) return false;
+
+    std::string_view name = skip_list_spaces(rest);
+    if (type == 'l') {
+        size_t arrow = name.find(" -> ");
+        if (arrow != std::string_view::npos) name = name.substr(0, arrow);
+    }
+    if (name.empty()) return false;
+    entry = { name, type == 'd', size, parse_unix_list_time(month, day, time_or_year), {} };
+    return true;
+}
+
+// 01-15-20  10:30AM       <DIR>          name
+static bool parse_dos_list_line(std::string_view line, FtpEntryView& entry) {
+    std::string_view rest = line;
+    std::string_view date = next_list_token(rest);
+    if (date.size() < 8 || (date[2] != '-' && date[2] != '/')) return false;
+    std::string_view time = next_list_token(rest);
+    if (time.empty() || time[0] < '0' || time[0] > '9') return false;
+    std::string_view size_field = next_list_token(rest);
+    if (size_field == "AM" || size_field == "PM") size_field = next_list_token(rest);
+
+    bool is_dir = (size_field == "<DIR>");
+    uintmax_t size = 0;
+    if (!is_dir && !parse_list_number(size_field, size)) return false;
+    std::string_view name = skip_list_spaces(rest);
+    if (name.empty()) return false;
+
+    int month = 0, day = 0, year = 0, hour = 0, minute = 0;
+    time_t mtime = 0;
+    if (parse_fixed_number(date, 0, 2, month) && parse_fixed_number(date, 3, 2, day)
+        && parse_fixed_number(date, 6, date.size() - 6, year)
+        && parse_fixed_number(time, 0, 2, hour) && parse_fixed_number(time, 3, 2, minute)) {
+        if (year < 100) year += (year < 70) ? 2000 : 1900;
+        std::string_view suffix = time.size() > 5 ? time.substr(5) : size_field;
+        if (!suffix.empty() && (suffix[0] == 'P' || suffix[0] == 'p') && hour < 12) hour += 12;
+        if (!suffix.empty() && (suffix[0] == 'A' || suffix[0] == 'a') && hour == 12) hour = 0;
+        mtime = make_utc_time(year, month - 1, day, hour, minute, 0);
+    }
+    entry = { name, is_dir, size, mtime, {} };
+    return true;
+}
+
+static bool parse_list_line(std::string_view line, FtpEntryView& entry) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.remove_suffix(1);
+    if (line.empty() || line.substr(0, 6) == "total ") return false;
+    bool parsed = (line[0] >= '0' && line[0] <= '9') ? parse_dos_list_line(line, entry)
+                                                     : parse_unix_list_line(line, entry);
+    if (!parsed) entry = { line, false, 0, 0, {} };
+    return true;
+}
+
+static bool fact_name_equals(std::string_view fact, std::string_view name) {
+    if (fact.size() != name.size()) return false;
+    for (size_t i = 0; i < fact.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(fact[i])) != name[i]) return false;
+    }
+    return true;
+}
+
+// type=file;size=1024;modify=20200115103000;unique=801g4; name (RFC 3659)
+static bool parse_mlsd_line(std::string_view line, FtpEntryView& entry) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) line.remove_suffix(1);
+    size_t space = line.find(' ');
+    if (space == std::string_view::npos || space + 1 >= line.size()) return false;
+    std::string_view facts = line.substr(0, space);
+    entry = { line.substr(space + 1), false, 0, 0, {} };
+
+    while (!facts.empty()) {
+        size_t semicolon = facts.find(';');
+        std::string_view fact = facts.substr(0, semicolon);
+        facts.remove_prefix(semicolon == std::string_view::npos ? facts.size() : semicolon + 1);
+        size_t eq = fact.find('=');
+        if (eq == std::string_view::npos) continue;
+        std::string_view key = fact.substr(0, eq);
+        std::string_view value = fact.substr(eq + 1);
+        if (fact_name_equals(key, "type")) {
+            if (fact_name_equals(value, "cdir") || fact_name_equals(value, "pdir")) return false;
+            entry.is_directory = fact_name_equals(value, "dir");
+        } else if (fact_name_equals(key, "size")) {
+            parse_list_number(value, entry.size);
+        } else if (fact_name_equals(key, "modify")) {
+            int year, month, day, hour, minute, second;
+            if (parse_fixed_number(value, 0, 4, year) && parse_fixed_number(value, 4, 2, month)
+                && parse_fixed_number(value, 6, 2, day) && parse_fixed_number(value, 8, 2, hour)
+                && parse_fixed_number(value, 10, 2, minute) && parse_fixed_number(value, 12, 2, second)) {
+                entry.mtime = make_utc_time(year, month - 1, day, hour, minute, second);
+            }
+        } else if (fact_name_equals(key, "unique")) {
+            entry.unique_id = value;
+        }
     }
+    return true;
+}
+
+static bool parse_listing_line(std::string_view line, FtpEntryView& entry, bool machine_listing) {
+    return machine_listing ? parse_mlsd_line(line, entry) : parse_list_line(line, entry);
+}
+
+struct LocalTreeEntry {
+    bool is_directory;
+    uintmax_t size;
+    time_t mtime;
+    long mtime_nsec = 0;
+
+    int64_t mtime_ns() const { return (int64_t)mtime * 1000000000 + mtime_nsec; }
+};
+
+static bool collect_local_tree(const std::string& root, std::map<std::string, LocalTreeEntry>& tree) {
+    std::error_code ec;
+    fs::recursive_directory_iterator it(root, ec), end;
+    if (ec) {
+        std::cerr << "Ошибка чтения локальной директории '" << root << "': " << ec.message() << std::endl;
+        return false;
+    }
+    for (; it != end; it.increment(ec)) {
+        if (ec) break;
+        struct stat st;
+        if (stat(it->path().c_str(), &st) != 0) continue;
+        bool is_directory = S_ISDIR(st.st_mode);
+        if (!is_directory && !S_ISREG(st.st_mode)) continue;
+        tree[it->path().lexically_relative(root).generic_string()] = { is_directory, is_directory ? 0 : (uintmax_t)st.st_size, st.st_mtime, st.st_mtim.tv_nsec };
+    }
+    if (ec) {
+        std::cerr << "Ошибка обхода локальной директории '" << root << "': " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Общая часть дисковых индексов (UploadIndex, ListingStore): файл отображается в память
+// целиком; за заголовком с магией лежит ключ (корень или сервер), таблицы начинаются с
+// 8-байтной границы. Запись идет во временный файл и заменяет старый через rename.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { unmap(); }
+
+    static size_t align(size_t offset) { return (offset + 7) / 8 * 8; }
+
+    bool map(const std::string& path, size_t header_size) {
+        unmap();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= header_size) {
+            length = (size_t)st.st_size;
+            void *memory = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            mapping = memory == MAP_FAILED ? nullptr : (const char *)memory;
+        }
+        ::close(fd);
+        if (!mapping) length = 0;
+        return mapping != nullptr;
+    }
+
+    const char* data() const { return mapping; }
+    size_t size() const { return length; }
+
+    // Смещение первой таблицы, если магия и ключ совпали, иначе 0.
+    size_t tables_offset(const char (&magic)[8], size_t header_size, uint64_t key_length, std::string_view key) const {
+        if (!mapping || memcmp(mapping, magic, sizeof(magic)) != 0 || key_length > length - header_size) return 0;
+        size_t offset = align(header_size + (size_t)key_length);
+        if (offset > length || std::string_view(mapping + header_size, (size_t)key_length) != key) return 0;
+        return offset;
+    }
+
+    static bool write(const std::string& path, const void *header, size_t header_size, std::string_view key,
+                      std::initializer_list<std::string_view> tables) {
+        std::string temp_path = path + ".tmp";
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write((const char *)header, (std::streamsize)header_size);
+        out.write(key.data(), (std::streamsize)key.size());
+        static const char padding[8] = {};
+        out.write(padding, (std::streamsize)(align(header_size + key.size()) - header_size - key.size()));
+        for (const auto& table : tables) out.write(table.data(), (std::streamsize)table.size());
+        out.close();
+        std::error_code ec;
+        if (out) fs::rename(temp_path, path, ec);
+        if (!out || ec) {
+            fs::remove(temp_path, ec);
+            return false;
+        }
+        return true;
+    }
+
+    void unmap() {
+        if (mapping) munmap((void *)mapping, length);
+        mapping = nullptr;
+        length = 0;
+    }
+
+private:
+    const char *mapping = nullptr;
+    size_t length = 0;
+};
+
+// Индекс rmirror: что и в каком виде уже лежит на сервере. Файл рядом с деревом содержит
+// заголовок, отсортированную по пути таблицу записей фиксированного размера и блок имен;
+// он отображается в память целиком, поиск - двоичный, поэтому запуск стоит одного обхода диска.
+class UploadIndex {
+public:
+    static constexpr const char* file_name = ".ftp_upload_index";
+
+    struct Record {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t flags;
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t remote_mtime;
+        unsigned char sha256[32];
+    };
+    enum : uint32_t { directory_flag = 1, digest_flag = 2 };
+
+    UploadIndex() = default;
+    UploadIndex(const UploadIndex&) = delete;
+    UploadIndex& operator=(const UploadIndex&) = delete;
+    ~UploadIndex() { unmap(); }
+
+    // Индекс, построенный для другого удаленного корня, не используется.
+    bool load(const std::string& path, const std::string& remote_root) {
+        unmap();
+        if (!file.map(path, sizeof(Header))) return false;
+        const Header *header = (const Header *)file.data();
+        size_t records_offset = file.tables_offset(magic, sizeof(Header), header->root_length, remote_root);
+        if (records_offset == 0 || header->count > (file.size() - records_offset) / sizeof(Record)) {
+            unmap();
+            return false;
+        }
+        records = (const Record *)(file.data() + records_offset);
+        count = (size_t)header->count;
+        names = file.data() + records_offset + count * sizeof(Record);
+        names_length = file.size() - records_offset - count * sizeof(Record);
+        for (size_t i = 0; i < count; ++i) {
+            if (records[i].name_offset + records[i].name_length > names_length) {
+                unmap();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const Record* find(std::string_view relative) const {
+        const Record *end = records + count;
+        const Record *found = std::lower_bound(records, end, relative, [this](const Record& record, std::string_view key) { return name(record) < key; });
+        return found != end && name(*found) == relative ? found : nullptr;
+    }
+
+    void put(const std::string& relative, bool directory, uintmax_t size, int64_t mtime_ns, int64_t remote_mtime, const std::string& sha256) {
+        Record record{ 0, 0, directory ? (uint32_t)directory_flag : 0u, (uint64_t)size, mtime_ns, remote_mtime, {} };
+        if (sha256.size() == sizeof(record.sha256)) {
+            memcpy(record.sha256, sha256.data(), sizeof(record.sha256));
+            record.flags |= digest_flag;
+        }
+        updates[relative] = record;
+    }
+
+    size_t size() const { return count; }
+
+    // Старые записи сливаются с обновлениями; пути, для которых keep() вернул false, выпадают.
+    bool save(const std::string& path, const std::string& remote_root, const std::function<bool(std::string_view)>& keep) {
+        std::vector<Record> merged;
+        std::string merged_names;
+        merged.reserve(count + updates.size());
+        auto append = [&](std::string_view relative, Record record) {
+            if (!keep(relative)) return;
+            record.name_offset = merged_names.size();
+            record.name_length = (uint32_t)relative.size();
+            merged_names.append(relative.data(), relative.size());
+            merged.push_back(record);
+        };
+        size_t i = 0;
+        for (auto update = updates.begin(); i < count || update != updates.end();) {
+            bool take_old = update == updates.end() || (i < count && name(records[i]) < std::string_view(update->first));
+            if (take_old) {
+                append(name(records[i]), records[i]);
+                ++i;
+                continue;
+            }
+            if (i < count && name(records[i]) == update->first) ++i;
+            append(update->first, update->second);
+            ++update;
+        }
+
+        Header header{};
+        memcpy(header.magic, magic, sizeof(header.magic));
+        header.count = merged.size();
+        header.root_length = remote_root.size();
+        std::string_view table((const char *)merged.data(), merged.size() * sizeof(Record));
+        if (!MappedFile::write(path, &header, sizeof(header), remote_root, { table, merged_names })) {
+            std::cerr << "Не удалось сохранить индекс '" << path << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t count;
+        uint64_t root_length;
+    };
+    static constexpr char magic[8] = { 'F', 'T', 'P', 'I', 'D', 'X', '1', '\0' };
+
+    MappedFile file;
+    const Record *records = nullptr;
+    size_t count = 0;
+    const char *names = nullptr;
+    size_t names_length = 0;
+    std::map<std::string, Record> updates;
+
+    std::string_view name(const Record& record) const { return std::string_view(names + record.name_offset, record.name_length); }
+
+    void unmap() {
+        file.unmap();
+        records = nullptr;
+        count = 0;
+    }
+};
+
+// Дисковый кэш листингов одного сервера. Формат как у UploadIndex: заголовок, отсортированная
+// по пути таблица директорий, общая таблица записей и пул строк, в котором одинаковые имена
+// и пути хранятся один раз. Файл отображается в память, директория читается только по запросу.
+class ListingStore {
+public:
+    struct Directory {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t entry_count;
+        uint64_t first_entry;
+        int64_t fetched_at;
+        int64_t directory_mtime;
+    };
+    struct Entry {
+        uint64_t name_offset;
+        uint64_t unique_offset;
+        uint32_t name_length;
+        uint32_t unique_length;
+        uint64_t size;
+        int64_t mtime;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+    enum : uint32_t { directory_flag = 1 };
+
+    struct Listing {
+        time_t fetched_at;
+        time_t directory_mtime;
+        std::vector<FtpEntry> entries;
+    };
+
+    ListingStore() = default;
+    ListingStore(const ListingStore&) = delete;
+    ListingStore& operator=(const ListingStore&) = delete;
+    ~ListingStore() { close(); }
+
+    // Кэш другого сервера или пользователя не используется.
+    bool load(const std::string& path, const std::string& server) {
+        close();
+        if (!file.map(path, sizeof(Header))) return false;
+        const Header *header = (const Header *)file.data();
+        size_t directories_offset = file.tables_offset(magic, sizeof(Header), header->server_length, server);
+        size_t available = directories_offset ? file.size() - directories_offset : 0;
+        bool valid = directories_offset != 0
+                  && header->directory_count <= available / sizeof(Directory)
+                  && header->entry_count <= (available - header->directory_count * sizeof(Directory)) / sizeof(Entry);
+        if (valid) {
+            directories = (const Directory *)(file.data() + directories_offset);
+            directory_count = (size_t)header->directory_count;
+            entries = (const Entry *)(directories + directory_count);
+            entry_count = (size_t)header->entry_count;
+            strings = (const char *)(entries + entry_count);
+            strings_length = file.size() - (size_t)(strings - file.data());
+            for (size_t i = 0; i < directory_count && valid; ++i) {
+                const Directory& directory = directories[i];
+                valid = directory.path_offset + directory.path_length <= strings_length
+                     && directory.first_entry + directory.entry_count <= entry_count;
+            }
+            for (size_t i = 0; i < entry_count && valid; ++i) {
+                valid = entries[i].name_offset + entries[i].name_length <= strings_length
+                     && entries[i].unique_offset + entries[i].unique_length <= strings_length;
+            }
+        }
+        if (!valid) close();
+        return valid;
+    }
+
+    const Directory* find(std::string_view path) const {
+        const Directory *end = directories + directory_count;
+        const Directory *found = std::lower_bound(directories, end, path,
+                                                  [this](const Directory& directory, std::string_view key) { return path_of(directory) < key; });
+        return found != end && path_of(*found) == path ? found : nullptr;
+    }
+
+    std::vector<FtpEntry> entries_of(const Directory& directory) const {
+        std::vector<FtpEntry> result;
+        result.reserve(directory.entry_count);
+        for (size_t i = 0; i < directory.entry_count; ++i) {
+            const Entry& entry = entries[directory.first_entry + i];
+            result.push_back({ std::string(string_at(entry.name_offset, entry.name_length)), (entry.flags & directory_flag) != 0,
+                               (uintmax_t)entry.size, (time_t)entry.mtime, std::string(string_at(entry.unique_offset, entry.unique_length)) });
+        }
+        return result;
+    }
+
+    size_t size() const { return directory_count; }
+    const Directory& directory(size_t i) const { return directories[i]; }
+    std::string_view path_of(const Directory& directory) const { return string_at(directory.path_offset, directory.path_length); }
+
+    static bool save(const std::string& path, const std::string& server, const std::map<std::string, Listing>& listings) {
+        std::vector<Directory> directory_table;
+        std::vector<Entry> entry_table;
+        std::string pool;
+        std::unordered_map<std::string, uint64_t> interned;
+        auto intern = [&](const std::string& text) -> uint64_t {
+            if (text.empty()) return 0;
+            auto inserted = interned.emplace(text, pool.size());
+            if (inserted.second) pool += text;
+            return inserted.first->second;
+        };
+        directory_table.reserve(listings.size());
+        for (const auto& listing : listings) {
+            directory_table.push_back({ intern(listing.first), (uint32_t)listing.first.size(), (uint32_t)listing.second.entries.size(),
+                                        entry_table.size(), (int64_t)listing.second.fetched_at, (int64_t)listing.second.directory_mtime });
+            for (const auto& entry : listing.second.entries) {
+                entry_table.push_back({ intern(entry.name), intern(entry.unique_id), (uint32_t)entry.name.size(), (uint32_t)entry.unique_id.size(),
+                                        (uint64_t)entry.size, (int64_t)entry.mtime, entry.is_directory ? (uint32_t)directory_flag : 0u, 0 });
+            }
+        }
+
+        std::error_code ec;
+        fs::create_directories(fs::path(path).parent_path(), ec);
+        Header header{};
+        memcpy(header.magic, magic, sizeof(header.magic));
+        header.directory_count = directory_table.size();
+        header.entry_count = entry_table.size();
+        header.server_length = server.size();
+        std::string_view directory_bytes((const char *)directory_table.data(), directory_table.size() * sizeof(Directory));
+        std::string_view entry_bytes((const char *)entry_table.data(), entry_table.size() * sizeof(Entry));
+        if (!MappedFile::write(path, &header, sizeof(header), server, { directory_bytes, entry_bytes, pool })) {
+            std::cerr << "Не удалось сохранить кэш листингов '" << path << "'" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        file.unmap();
+        directories = nullptr;
+        directory_count = 0;
+        entries = nullptr;
+        entry_count = 0;
+        strings = nullptr;
+        strings_length = 0;
+    }
+
+private:
+    struct Header {
+        char magic[8];
+        uint64_t directory_count;
+        uint64_t entry_count;
+        uint64_t server_length;
+    };
+    static constexpr char magic[8] = { 'F', 'T', 'P', 'L', 'S', 'T', '1', '\0' };
+
+    MappedFile file;
+    const Directory *directories = nullptr;
+    size_t directory_count = 0;
+    const Entry *entries = nullptr;
+    size_t entry_count = 0;
+    const char *strings = nullptr;
+    size_t strings_length = 0;
+
+    std::string_view string_at(uint64_t offset, uint32_t length) const { return std::string_view(strings + offset, length); }
+};
+
+// LIST отдает время с точностью до минуты (или до дня для старых файлов)
+static time_t listing_time_granularity(time_t mtime) {
+    if (mtime % 86400 == 0) return 86400;
+    if (mtime % 60 == 0) return 60;
+    return 2;
+}
+
+static void set_local_mtime(const std::string& path, time_t mtime) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+class ListingStreamParser {
+public:
+    using Sink = std::function<void(const FtpEntryView&)>;
+
+    ListingStreamParser(bool machine_listing, Sink sink)
+        : machine_listing(machine_listing), sink(std::move(sink)), count(0) {}
+
+    void feed(const char *data, size_t length) {
+        std::string_view chunk(data, length);
+        if (!carry.empty()) {
+            size_t eol = chunk.find('\n');
+            if (eol == std::string_view::npos) {
+                carry.append(chunk.data(), chunk.size());
+                return;
+            }
+            carry.append(chunk.data(), eol);
+            emit(carry);
+            carry.clear();
+            chunk.remove_prefix(eol + 1);
+        }
+        while (!chunk.empty()) {
+            size_t eol = chunk.find('\n');
+            if (eol == std::string_view::npos) {
+                carry.assign(chunk.data(), chunk.size());
+                return;
+            }
+            emit(chunk.substr(0, eol));
+            chunk.remove_prefix(eol + 1);
+        }
+    }
+
+    void finish() {
+        if (!carry.empty()) {
+            emit(carry);
+            carry.clear();
+        }
+    }
+
+    size_t entries() const { return count; }
+
+private:
+    bool machine_listing;
+    Sink sink;
+    std::string carry;
+    size_t count;
+
+    void emit(std::string_view line) {
+        FtpEntryView entry;
+        if (!parse_listing_line(line, entry, machine_listing)) return;
+        ++count;
+        sink(entry);
+    }
+};
+
+static size_t write_listing_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    ((ListingStreamParser*)userp)->feed((const char*)contents, size * nmemb);
+    return size * nmemb;
+}
+
+// Шаблон имени в стиле shell (*, ?, [a-z], [!...], \x), разобранный один раз в список токенов.
+// Сопоставление идет без std::regex: при несовпадении откатываемся только к последней '*'.
+class GlobPattern {
+public:
+    explicit GlobPattern(const std::string& pattern) {
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            if (c == '*') {
+                if (tokens.empty() || tokens.back().kind != Kind::any_run) tokens.push_back({ Kind::any_run, {}, {} });
+            } else if (c == '?') {
+                tokens.push_back({ Kind::any_char, {}, {} });
+            } else if (c == '[' && parse_set(pattern, i)) {
+                continue;
+            } else {
+                if (c == '\\' && i + 1 < pattern.size()) c = pattern[++i];
+                if (tokens.empty() || tokens.back().kind != Kind::literal) tokens.push_back({ Kind::literal, {}, {} });
+                tokens.back().text += c;
+            }
+        }
+    }
+
+    static bool is_glob(const std::string& text) { return text.find_first_of("*?[") != std::string::npos; }
+
+    bool matches(std::string_view name) const {
+        size_t t = 0, p = 0;
+        size_t star_token = std::string::npos, star_position = 0;
+        while (p < name.size() || t < tokens.size()) {
+            if (t < tokens.size()) {
+                const Token& token = tokens[t];
+                if (token.kind == Kind::any_run) {
+                    star_token = t++;
+                    star_position = p;
+                    continue;
+                }
+                size_t length = token.kind == Kind::literal ? token.text.size() : 1;
+                if (p + length <= name.size() && token_matches(token, name.substr(p, length))) {
+                    p += length;
+                    ++t;
+                    continue;
+                }
+            }
+            if (star_token == std::string::npos || star_position >= name.size()) return false;
+            t = star_token + 1;
+            p = ++star_position;
+        }
+        return true;
+    }
+
+private:
+    enum class Kind : uint8_t { literal, any_char, any_run, char_set };
+    struct Token {
+        Kind kind;
+        std::string text;
+        std::bitset<256> set;
+    };
+    std::vector<Token> tokens;
+
+    static bool token_matches(const Token& token, std::string_view text) {
+        switch (token.kind) {
+            case Kind::literal: return text == token.text;
+            case Kind::char_set: return token.set.test(static_cast<unsigned char>(text[0]));
+            default: return true;
+        }
+    }
+
+    // [abc], [a-z], [!x] или [^x]; ']' сразу после открывающей скобки и '\x' считаются символами.
+    bool parse_set(const std::string& pattern, size_t& i) {
+        size_t j = i + 1;
+        bool negated = j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^');
+        if (negated) ++j;
+        std::bitset<256> set;
+        size_t first = j;
+        auto take = [&](size_t& k) {
+            if (pattern[k] == '\\' && k + 1 < pattern.size()) ++k;
+            return static_cast<unsigned char>(pattern[k++]);
+        };
+        while (j < pattern.size() && (pattern[j] != ']' || j == first)) {
+            unsigned char from = take(j);
+            if (j + 1 < pattern.size() && pattern[j] == '-' && pattern[j + 1] != ']') {
+                ++j;
+                unsigned char to = take(j);
+                for (unsigned c = from; c <= to; ++c) set.set(c);
+            } else {
+                set.set(from);
+            }
+        }
+        if (j >= pattern.size()) return false;
+        if (negated) set.flip();
+        tokens.push_back({ Kind::char_set, {}, set });
+        i = j;
+        return true;
+    }
+};
+
+enum class ListingSort { natural, name, size, time };
+
+struct ListingView {
+    size_t limit = 0;
+    size_t page_rows = 0;
+    bool color = isatty(STDOUT_FILENO);
+    ListingSort sort = ListingSort::natural;
+    bool show_time = false;
+};
+
+// Листинг в виде структуры массивов: имена лежат подряд в одном буфере (с завершающим '\0'),
+// сортируется только вектор индексов, поэтому строки при сортировке не перемещаются.
+class ListingTable {
+public:
+    void reserve(size_t count) {
+        offsets.reserve(count);
+        lengths.reserve(count);
+        directories.reserve(count);
+        sizes.reserve(count);
+        mtimes.reserve(count);
+    }
+
+    size_t add(std::string_view name, bool is_directory, uintmax_t size, time_t mtime) {
+        offsets.push_back((uint32_t)names.size());
+        lengths.push_back((uint32_t)name.size());
+        names.append(name.data(), name.size());
+        names += '\0';
+        directories.push_back(is_directory ? 1 : 0);
+        sizes.push_back(size);
+        mtimes.push_back(mtime);
+        return offsets.size() - 1;
+    }
+
+    size_t size() const { return offsets.size(); }
+    std::string_view name(size_t i) const { return std::string_view(names.data() + offsets[i], lengths[i]); }
+    const char* c_name(size_t i) const { return names.data() + offsets[i]; }
+
+    std::vector<uint8_t> directories;
+    std::vector<uintmax_t> sizes;
+    std::vector<time_t> mtimes;
+
+    // Порядок вывода; при limit < size() сортируются только первые limit записей
+    // (nth_element + sort префикса).
+    std::vector<uint32_t> order(ListingSort sort, size_t limit) const {
+        std::vector<uint32_t> indices(size());
+        for (uint32_t i = 0; i < indices.size(); ++i) indices[i] = i;
+        if (sort == ListingSort::natural) {
+            if (limit > 0 && limit < indices.size()) indices.resize(limit);
+            return indices;
+        }
+        auto by_name = [this](uint32_t a, uint32_t b) {
+            if (directories[a] != directories[b]) return directories[a] > directories[b];
+            return name(a) < name(b);
+        };
+        auto by_size = [this](uint32_t a, uint32_t b) {
+            if (sizes[a] != sizes[b]) return sizes[a] > sizes[b];
+            return name(a) < name(b);
+        };
+        auto by_time = [this](uint32_t a, uint32_t b) {
+            if (mtimes[a] != mtimes[b]) return mtimes[a] > mtimes[b];
+            return name(a) < name(b);
+        };
+        auto arrange = [&](auto compare) {
+            if (limit > 0 && limit < indices.size()) {
+                std::nth_element(indices.begin(), indices.begin() + limit, indices.end(), compare);
+                indices.resize(limit);
+            }
+            std::sort(indices.begin(), indices.end(), compare);
+        };
+        if (sort == ListingSort::size) arrange(by_size);
+        else if (sort == ListingSort::time) arrange(by_time);
+        else arrange(by_name);
+        return indices;
+    }
+
+private:
+    std::string names;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+};
+
+// Собирает строки листинга в один буфер и пишет его целиком: один раз в конце,
+// постранично при --page или кусками по 64 КБ на очень больших листингах.
+class ListingRenderer {
+public:
+    ListingRenderer(std::string title, const ListingView& view) : view(view) {
+        buffer.reserve(flush_threshold);
+        buffer += "\n--- ";
+        buffer += title;
+        buffer += " ---\n";
+        append_padded("Тип", 6);
+        append_padded("Имя", 40);
+        append_padded("Размер", 15, true);
+        if (view.show_time) append_padded("Изменен", 18, true);
+        buffer += '\n';
+        buffer.append(line_width(), '-');
+        buffer += '\n';
+    }
+
+    ListingRenderer(const ListingRenderer&) = delete;
+    ListingRenderer& operator=(const ListingRenderer&) = delete;
+
+    ~ListingRenderer() { finish(); }
+
+    // false - строк больше не нужно (лимит или выход из пейджера)
+    bool row(std::string_view name, bool is_directory, uintmax_t size, time_t mtime = 0) {
+        if (stopped) return false;
+        if (view.limit > 0 && rows >= view.limit) {
+            ++skipped;
+            return false;
+        }
+        if (view.color) buffer += is_directory ? COLOR_DIR : COLOR_FILE;
+        append_padded(is_directory ? "DIR" : "FILE", 6);
+        append_padded(name, 40);
+        if (view.color) buffer += COLOR_RESET;
+        if (is_directory) {
+            append_padded("-", 15, true);
+        } else {
+            if (view.color) buffer += COLOR_SIZE;
+            append_padded(format_size_human(size), 15, true);
+            if (view.color) buffer += COLOR_RESET;
+        }
+        if (view.show_time) {
+            char stamp[32] = "-";
+            struct tm tm_value;
+            if (mtime > 0 && localtime_r(&mtime, &tm_value)) strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &tm_value);
+            append_padded(stamp, 18, true);
+        }
+        buffer += '\n';
+        ++rows;
+        if (view.page_rows > 0 && rows % view.page_rows == 0) {
+            page_break();
+        } else if (buffer.size() >= flush_threshold) {
+            write_buffer();
+        }
+        return !stopped;
+    }
+
+    void finish() {
+        if (finished) return;
+        finished = true;
+        buffer.append(line_width(), '-');
+        buffer += '\n';
+        if (skipped > 0) {
+            buffer += "Показано записей: " + std::to_string(rows) + " (лимит " + std::to_string(view.limit) + ")\n";
+        }
+        write_buffer();
+        std::cout.flush();
+    }
+
+    void discard() {
+        buffer.clear();
+        finished = true;
+    }
+
+    size_t shown() const { return rows; }
+
+    // Записи, отброшенные до рендерера (top-N по отсортированной таблице).
+    void note_skipped(size_t count) { skipped += count; }
+
+    void render(const ListingTable& table) {
+        for (uint32_t index : table.order(view.sort, view.limit)) {
+            if (!row(table.name(index), table.directories[index], table.sizes[index], table.mtimes[index])) break;
+        }
+        if (view.limit > 0 && table.size() > view.limit) note_skipped(table.size() - view.limit);
+    }
+
+    static size_t terminal_rows() {
+        struct winsize size;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 4) return size.ws_row - 2;
+        return 40;
+    }
+
+private:
+    static constexpr size_t flush_threshold = 64 * 1024;
+
+    ListingView view;
+    std::string buffer;
+    size_t rows = 0;
+    size_t skipped = 0;
+    bool stopped = false;
+    bool finished = false;
+
+    size_t line_width() const { return view.show_time ? 79 : 61; }
+
+    // Ширина в символах, а не в байтах, чтобы кириллица не ломала колонки.
+    static size_t display_width(std::string_view text) {
+        size_t width = 0;
+        for (unsigned char c : text) {
+            if ((c & 0xC0) != 0x80) ++width;
+        }
+        return width;
+    }
+
+    void append_padded(std::string_view text, size_t width, bool right = false) {
+        size_t used = display_width(text);
+        size_t padding = used < width ? width - used : 0;
+        if (right) buffer.append(padding, ' ');
+        buffer.append(text.data(), text.size());
+        if (!right) buffer.append(padding, ' ');
+    }
+
+    void write_buffer() {
+        if (buffer.empty()) return;
+        std::cout.write(buffer.data(), (std::streamsize)buffer.size());
+        buffer.clear();
+    }
+
+    void page_break() {
+        write_buffer();
+        if (!isatty(STDIN_FILENO)) return;
+        std::cout << "-- далее: Enter, q - выход --" << std::flush;
+        std::string answer;
+        if (!std::getline(std::cin, answer) || answer == "q" || answer == "Q") stopped = true;
+    }
+};
+
+class LocalFileManager {
+private:
+    static bool stat_entry(int dir_fd, ListingTable& table, size_t index, bool use_statx) {
+#ifdef STATX_SIZE
+        if (use_statx) {
+            struct statx stx;
+            if (statx(dir_fd, table.c_name(index), AT_STATX_DONT_SYNC, STATX_TYPE | STATX_SIZE | STATX_MTIME, &stx) != 0) return false;
+            table.directories[index] = S_ISDIR(stx.stx_mode);
+            table.sizes[index] = S_ISREG(stx.stx_mode) ? stx.stx_size : 0;
+            table.mtimes[index] = (time_t)stx.stx_mtime.tv_sec;
+            return true;
+        }
+#endif
+        (void)use_statx;
+        struct stat st;
+        if (fstatat(dir_fd, table.c_name(index), &st, 0) != 0) return false;
+        table.directories[index] = S_ISDIR(st.st_mode);
+        table.sizes[index] = S_ISREG(st.st_mode) ? (uintmax_t)st.st_size : 0;
+        table.mtimes[index] = st.st_mtime;
+        return true;
+    }
+
+    // Размеры недиректорий: по одному stat на запись относительно дескриптора директории,
+    // при threads > 1 - параллельными statx (полезно на NFS и других сетевых ФС).
+    static void resolve_sizes(const fs::path& directory, ListingTable& table,
+                              const std::vector<size_t>& pending, size_t threads) {
+        if (pending.empty()) return;
+        int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) return;
+        threads = std::min(threads, pending.size());
+        if (threads <= 1) {
+            for (size_t index : pending) stat_entry(dir_fd, table, index, false);
+        } else {
+            std::atomic<size_t> next{0};
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; ++t) {
+                workers.emplace_back([&] {
+                    for (size_t i = next++; i < pending.size(); i = next++) stat_entry(dir_fd, table, pending[i], true);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+        }
+        ::close(dir_fd);
+    }
+
+public:
+    void list_directory(size_t stat_threads = 1, ListingView view = ListingView()) {
+        try {
+            ListingTable table;
+            std::vector<size_t> pending;
+            bool need_times = view.show_time || view.sort == ListingSort::time;
+            fs::path directory = fs::current_path();
+            for (const auto& entry : fs::directory_iterator(directory)) {
+                std::error_code ec;
+                bool is_directory = entry.is_directory(ec);
+                size_t index = table.add(entry.path().filename().native(), is_directory, 0, 0);
+                if (!is_directory || need_times) pending.push_back(index);
+            }
+            resolve_sizes(directory, table, pending, stat_threads);
+
+            if (view.sort == ListingSort::natural) view.sort = ListingSort::name;
+            ListingRenderer renderer("Локальная директория \"" + directory.string() + "\"", view);
+            renderer.render(table);
+        } catch (const fs::filesystem_error& e) {
+            std::cerr << "Ошибка листинга локальной директории: " << e.what() << std::endl;
+        }
+    }
+
+    void change_directory(const std::string& path_str) {
+        fs::path p(path_str);
+        std::error_code ec;
+        fs::current_path(p, ec);
+        if (ec) {
+            std::cerr << "Ошибка смены локальной директории: " << ec.message() << std::endl;
+        } else {
+            std::cout << "Локальная директория изменена на: " << fs::current_path() << std::endl;
+        }
+    }
+
+    void create_directory(const std::string& path_str) {
+        std::error_code ec;
+        if (fs::create_directory(path_str, ec)) {
+            std::cout << "Локальная директория '" << path_str << "' создана." << std::endl;
+        } else if (ec.value() != 0 && ec.value() != EEXIST) {
+            std::cerr << "Ошибка создания локальной директории: " << ec.message() << std::endl;
+        } else {
+             std::cout << "Локальная директория '" << path_str << "' уже существует или произошла иная ошибка." << std::endl;
+        }
+    }
+
+    void remove_path(const std::string& path_str) {
+        std::error_code ec;
+        if (fs::remove(path_str, ec)) {
+            std::cout << "Файл/директория '" << path_str << "' удален(а)." << std::endl;
+        } else {
+            std::cerr << "Ошибка удаления '" << path_str << "': " << ec.message() << std::endl;
+        }
+    }
+
+    void move_path(const std::string& from_str, const std::string& to_str) {
+        std::error_code ec;
+        fs::rename(from_str, to_str, ec);
+        if (ec) {
+            std::cerr << "Ошибка перемещения/переименования: " << ec.message() << std::endl;
+        } else {
+            std::cout << "Перемещено/переименовано из '" << from_str << "' в '" << to_str << "'" << std::endl;
+        }
+    }
+};
+
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds) : bounds(std::move(bounds)), counts(this->bounds.size() + 1, 0) {}
+
+    void add(double value) {
+        size_t bucket = std::upper_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        if (bucket > 0 && bounds[bucket - 1] == value) --bucket;
+        ++counts[bucket];
+        ++total;
+        sum += value;
+        maximum = std::max(maximum, value);
+    }
+
+    // Верхняя граница корзины, в которую попадает квантиль q.
+    double quantile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)std::ceil(q * (double)total), seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank) return i < bounds.size() ? std::min(bounds[i], maximum) : maximum;
+        }
+        return maximum;
+    }
+
+    std::vector<double> bounds;
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    double sum = 0;
+    double maximum = 0;
+};
+
+// AIMD-регулятор числа соединений для "-j auto". Раз в эпоху (не чаще секунды, и только пока
+// в очереди есть работа) сравнивает общую скорость с предыдущей эпохой: рост на 5% и больше
+// добавляет соединение, падение на 20% или рост времени до первого байта вдвое против лучшего
+// убирает четверть. Отказ сервера из-за числа сессий (421, 530 после успешных входов) делит
+// уровень пополам и запоминает предел сервера, выше которого регулятор больше не поднимается.
+class ConcurrencyController {
+public:
+    struct Report {
+        size_t level = 0;
+        size_t peak = 0;
+        size_t server_limit = 0;
+        uint64_t rejections = 0;
+        uint64_t increases = 0;
+        uint64_t decreases = 0;
+        double throughput = 0;
+        double best_throughput = 0;
+    };
+
+    static constexpr size_t initial_level = 4;
+
+    explicit ConcurrencyController(size_t ceiling = 32) : ceiling(ceiling) { reset(); }
+
+    void reset() {
+        state = Report();
+        state.level = std::min(initial_level, ceiling);
+        state.peak = state.level;
+        successes = 0;
+        previous_throughput = 0;
+        baseline_latency = -1;
+        stable_epochs = 0;
+        start_epoch();
+    }
+
+    void set_ceiling(size_t value) {
+        ceiling = value ? value : 1;
+        state.level = std::min(state.level, ceiling);
+    }
+
+    size_t max_level() const { return ceiling; }
+    size_t level() const { return state.level; }
+    const Report& report() const { return state; }
+    bool had_success() const { return successes > 0; }
+
+    void add_bytes(uint64_t bytes) { epoch_bytes += bytes; }
+
+    void finished(bool ok, double first_byte) {
+        if (!ok) return;
+        ++successes;
+        if (first_byte > 0) {
+            epoch_latency += first_byte;
+            ++epoch_files;
+        }
+    }
+
+    // active - сколько соединений было открыто вместе с отвергнутым.
+    void rejected(size_t active) {
+        ++state.rejections;
+        size_t limit = active > 1 ? active - 1 : 1;
+        state.server_limit = state.server_limit ? std::min(state.server_limit, limit) : limit;
+        if (decreased_in_epoch) {
+            state.level = std::min(state.level, state.server_limit);
+            return;
+        }
+        state.level = std::max<size_t>(1, std::min(state.server_limit, state.level / 2));
+        ++state.decreases;
+        decreased_in_epoch = true;
+    }
+
+    // Новый вызов пула начинает сравнение скоростей заново, уровень и предел сервера сохраняются.
+    void begin_run() {
+        previous_throughput = 0;
+        stable_epochs = 0;
+        start_epoch();
+    }
+
+    bool epoch_due() const { return std::chrono::steady_clock::now() - epoch_started >= std::chrono::seconds(1); }
+
+    // Возвращает true, если уровень изменился.
+    bool tick(bool backlog) {
+        if (!epoch_due()) return false;
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch_started).count();
+        double throughput = (double)epoch_bytes / elapsed;
+        double latency = epoch_files ? epoch_latency / (double)epoch_files : -1;
+        bool rejected_in_epoch = decreased_in_epoch;
+        start_epoch();
+        if (throughput <= 0 && latency < 0) return false;
+        state.throughput = throughput;
+        state.best_throughput = std::max(state.best_throughput, throughput);
+        if (latency >= 0) baseline_latency = baseline_latency < 0 ? latency : std::min(baseline_latency, latency);
+        if (!backlog || rejected_in_epoch) {
+            previous_throughput = throughput;
+            return false;
+        }
+
+        size_t before = state.level;
+        size_t cap = state.server_limit ? std::min(ceiling, state.server_limit) : ceiling;
+        bool slower = previous_throughput > 0 && throughput < previous_throughput * 0.8;
+        bool congested = latency >= 0 && baseline_latency > 0 && latency > baseline_latency * 2 + 0.05;
+        if (slower || congested) {
+            state.level = std::max<size_t>(1, state.level - std::max<size_t>(1, state.level / 4));
+            ++state.decreases;
+            stable_epochs = 0;
+        } else if (previous_throughput == 0 || throughput >= previous_throughput * 1.05 || ++stable_epochs >= 3) {
+            if (state.level < cap) {
+                ++state.level;
+                ++state.increases;
+            }
+            stable_epochs = 0;
+        }
+        previous_throughput = throughput;
+        state.peak = std::max(state.peak, state.level);
+        return state.level != before;
+    }
+
+private:
+    size_t ceiling;
+    Report state;
+    uint64_t successes = 0;
+    double previous_throughput = 0;
+    double baseline_latency = -1;
+    int stable_epochs = 0;
+    std::chrono::steady_clock::time_point epoch_started;
+    uint64_t epoch_bytes = 0;
+    double epoch_latency = 0;
+    size_t epoch_files = 0;
+    bool decreased_in_epoch = false;
+
+    void start_epoch() {
+        epoch_started = std::chrono::steady_clock::now();
+        epoch_bytes = 0;
+        epoch_latency = 0;
+        epoch_files = 0;
+        decreased_in_epoch = false;
+    }
+};
+
+class TransferMetrics {
+public:
+    static constexpr const char* phase_names[] = { "dns", "connect", "tls", "setup", "first_byte", "transfer", "total" };
+    static constexpr size_t phase_count = sizeof(phase_names) / sizeof(phase_names[0]);
+
+    struct KindStats {
+        uint64_t transfers = 0;
+        uint64_t failures = 0;
+        uint64_t bytes = 0;
+        uint64_t connects = 0;
+    };
+
+    TransferMetrics() { reset(); }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<double> latency_bounds = { 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 };
+        phases.assign(phase_count, Histogram(latency_bounds));
+        throughput = Histogram({ 64 * 1024.0, 256 * 1024.0, 1024 * 1024.0, 4 * 1048576.0, 16 * 1048576.0, 64 * 1048576.0, 256 * 1048576.0, 1024 * 1048576.0 });
+        kinds.clear();
+        concurrency_known = false;
+    }
+
+    void record_concurrency(const ConcurrencyController::Report& report) {
+        std::lock_guard<std::mutex> lock(mutex);
+        concurrency = report;
+        concurrency_known = true;
+    }
+
+    static const char* classify(CURL *handle) {
+        char *url = nullptr;
+        curl_off_t upload_length = -1, uploaded = 0;
+        curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+        curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_UPLOAD_T, &upload_length);
+        curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+        if (upload_length >= 0 || uploaded > 0) return "put";
+        size_t length = url ? strlen(url) : 0;
+        if (length > 0 && url[length - 1] == '/') return "list";
+        return "get";
+    }
+
+    void record(CURL *handle, CURLcode res, const char* kind = nullptr) {
+        if (!handle) return;
+        if (!kind) kind = classify(handle);
+        curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_off_t downloaded = 0, uploaded = 0, speed_down = 0, speed_up = 0;
+        long connects = 0;
+        curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+        curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+        curl_easy_getinfo(handle, CURLINFO_SPEED_DOWNLOAD_T, &speed_down);
+        curl_easy_getinfo(handle, CURLINFO_SPEED_UPLOAD_T, &speed_up);
+        curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+
+        auto seconds = [](curl_off_t from, curl_off_t to) { return to > from ? (double)(to - from) / 1e6 : 0.0; };
+        curl_off_t connected = std::max(connect, appconnect);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        KindStats& stats = kinds[kind];
+        ++stats.transfers;
+        if (res != CURLE_OK) ++stats.failures;
+        stats.bytes += (uint64_t)(downloaded + uploaded);
+        stats.connects += (uint64_t)connects;
+        if (connects > 0) {
+            phases[0].add(namelookup / 1e6);
+            phases[1].add(seconds(namelookup, connect));
+            if (appconnect > 0) phases[2].add(seconds(connect, appconnect));
+        }
+        if (pretransfer > 0) phases[3].add(seconds(connected, pretransfer));
+        if (starttransfer > 0) {
+            phases[4].add(seconds(pretransfer, starttransfer));
+            phases[5].add(seconds(starttransfer, total));
+        }
+        phases[6].add(total / 1e6);
+        curl_off_t speed = std::max(speed_down, speed_up);
+        if (res == CURLE_OK && speed > 0 && (downloaded + uploaded) > 0 && std::string_view(kind) != "list") {
+            throughput.add((double)speed);
+        }
+    }
+
+    void print() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (kinds.empty()) {
+            std::cout << "Статистика пуста." << std::endl;
+            return;
+        }
+        std::cout << "Тип            всего    ошибок   соедин.            байт" << std::endl;
+        for (const auto& item : kinds) {
+            std::cout << std::left << std::setw(10) << item.first << std::right << std::setw(10) << item.second.transfers
+                      << std::setw(10) << item.second.failures << std::setw(10) << item.second.connects
+                      << std::setw(16) << format_size_human(item.second.bytes) << std::endl;
+        }
+        if (concurrency_known) {
+            std::cout << "\nАдаптивный пул: " << concurrency.level << " соединений (пик " << concurrency.peak << ", предел сервера "
+                      << (concurrency.server_limit ? std::to_string(concurrency.server_limit) : std::string("не найден"))
+                      << "), изменений +" << concurrency.increases << "/-" << concurrency.decreases << ", отказов " << concurrency.rejections
+                      << ", скорость " << format_size_human((uintmax_t)concurrency.throughput) << "/с (лучшая "
+                      << format_size_human((uintmax_t)concurrency.best_throughput) << "/с)" << std::endl;
+        }
+        std::cout << std::fixed << std::setprecision(2);
+        std::cout << "\nЗадержки по фазам, мс:" << std::endl;
+        std::cout << "фаза               n     сред.       p50       p90       p99     макс." << std::endl;
+        for (size_t i = 0; i < phase_count; ++i) {
+            const Histogram& h = phases[i];
+            if (h.total == 0) continue;
+            std::cout << std::left << std::setw(12) << phase_names[i] << std::right << std::setw(8) << h.total
+                      << std::setw(10) << h.sum / (double)h.total * 1e3 << std::setw(10) << h.quantile(0.5) * 1e3
+                      << std::setw(10) << h.quantile(0.9) * 1e3 << std::setw(10) << h.quantile(0.99) * 1e3
+                      << std::setw(10) << h.maximum * 1e3 << std::endl;
+        }
+        if (throughput.total > 0) {
+            std::cout << "\nСкорость передач:" << std::endl;
+            uint64_t widest = *std::max_element(throughput.counts.begin(), throughput.counts.end());
+            for (size_t i = 0; i < throughput.counts.size(); ++i) {
+                std::string label = i < throughput.bounds.size() ? "<= " + format_size_human((uintmax_t)throughput.bounds[i]) + "/с"
+                                                                 : "> " + format_size_human((uintmax_t)throughput.bounds.back()) + "/с";
+                size_t bar = widest ? (size_t)(throughput.counts[i] * 40 / widest) : 0;
+                std::cout << "  " << std::left << std::setw(16) << label << std::right << std::setw(6) << throughput.counts[i]
+                          << " " << std::string(bar, '#') << std::endl;
+            }
+        }
+        std::cout.unsetf(std::ios::floatfield);
+        std::cout << std::setprecision(6);
+    }
+
+    void write_json(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto histogram_json = [&out](const Histogram& h) {
+            out << "{\"count\":" << h.total << ",\"sum\":" << h.sum << ",\"max\":" << h.maximum << ",\"buckets\":[";
+            for (size_t i = 0; i < h.counts.size(); ++i) {
+                out << (i ? "," : "") << "{\"le\":";
+                if (i < h.bounds.size()) out << h.bounds[i]; else out << "\"+Inf\"";
+                out << ",\"count\":" << h.counts[i] << "}";
+            }
+            out << "]}";
+        };
+        out << "{\"transfers\":{";
+        bool first = true;
+        for (const auto& item : kinds) {
+            out << (first ? "" : ",") << "\"" << item.first << "\":{\"count\":" << item.second.transfers
+                << ",\"failures\":" << item.second.failures << ",\"connects\":" << item.second.connects
+                << ",\"bytes\":" << item.second.bytes << "}";
+            first = false;
+        }
+        out << "},\"phase_seconds\":{";
+        for (size_t i = 0; i < phase_count; ++i) {
+            out << (i ? "," : "") << "\"" << phase_names[i] << "\":";
+            histogram_json(phases[i]);
+        }
+        out << "},\"throughput_bytes_per_second\":";
+        histogram_json(throughput);
+        if (concurrency_known) {
+            out << ",\"concurrency\":{\"level\":" << concurrency.level << ",\"peak\":" << concurrency.peak
+                << ",\"server_limit\":" << concurrency.server_limit << ",\"increases\":" << concurrency.increases
+                << ",\"decreases\":" << concurrency.decreases << ",\"rejections\":" << concurrency.rejections
+                << ",\"throughput\":" << concurrency.throughput << ",\"best_throughput\":" << concurrency.best_throughput << "}";
+        }
+        out << "}" << std::endl;
+    }
+
+    void write_prometheus(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto histogram_text = [&out](const std::string& name, const std::string& labels, const Histogram& h) {
+            uint64_t cumulative = 0;
+            std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+            for (size_t i = 0; i < h.counts.size(); ++i) {
+                cumulative += h.counts[i];
+                out << name << "_bucket" << prefix << "le=\"";
+                if (i < h.bounds.size()) out << h.bounds[i]; else out << "+Inf";
+                out << "\"} " << cumulative << "\n";
+            }
+            std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+            out << name << "_sum" << suffix << " " << h.sum << "\n";
+            out << name << "_count" << suffix << " " << h.total << "\n";
+        };
+        out << "# TYPE ftp_transfers_total counter\n";
+        for (const auto& item : kinds) out << "ftp_transfers_total{kind=\"" << item.first << "\"} " << item.second.transfers << "\n";
+        out << "# TYPE ftp_transfer_failures_total counter\n";
+        for (const auto& item : kinds) out << "ftp_transfer_failures_total{kind=\"" << item.first << "\"} " << item.second.failures << "\n";
+        out << "# TYPE ftp_connects_total counter\n";
+        for (const auto& item : kinds) out << "ftp_connects_total{kind=\"" << item.first << "\"} " << item.second.connects << "\n";
+        out << "# TYPE ftp_transfer_bytes_total counter\n";
+        for (const auto& item : kinds) out << "ftp_transfer_bytes_total{kind=\"" << item.first << "\"} " << item.second.bytes << "\n";
+        out << "# TYPE ftp_phase_seconds histogram\n";
+        for (size_t i = 0; i < phase_count; ++i) histogram_text("ftp_phase_seconds", std::string("phase=\"") + phase_names[i] + "\"", phases[i]);
+        out << "# TYPE ftp_throughput_bytes_per_second histogram\n";
+        histogram_text("ftp_throughput_bytes_per_second", "", throughput);
+        if (concurrency_known) {
+            out << "# TYPE ftp_pool_connections gauge\nftp_pool_connections " << concurrency.level << "\n";
+            out << "# TYPE ftp_pool_server_limit gauge\nftp_pool_server_limit " << concurrency.server_limit << "\n";
+            out << "# TYPE ftp_pool_rejections_total counter\nftp_pool_rejections_total " << concurrency.rejections << "\n";
+        }
+        out.flush();
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<Histogram> phases;
+    Histogram throughput{{}};
+    std::map<std::string, KindStats> kinds;
+    ConcurrencyController::Report concurrency;
+    bool concurrency_known = false;
+};
+
+class ProgressLine {
+public:
+    ProgressLine(std::string label, bool enabled) : label(std::move(label)), enabled(enabled) {}
+
+    ~ProgressLine() { finish(); }
+
+    void update(curl_off_t total, curl_off_t now) {
+        if (!enabled || now <= 0) return;
+        auto current = std::chrono::steady_clock::now();
+        if (drawn && current - last_draw < std::chrono::milliseconds(200)) return;
+        double elapsed = std::chrono::duration<double>(current - started).count();
+        std::cerr << "\r" << label << "  " << format_size_human((uintmax_t)now);
+        if (total > 0) std::cerr << " / " << format_size_human((uintmax_t)total) << " (" << now * 100 / total << "%)";
+        if (elapsed > 0) std::cerr << "  " << format_size_human((uintmax_t)(now / elapsed)) << "/с";
+        std::cerr << "\033[K" << std::flush;
+        last_draw = current;
+        drawn = true;
+    }
+
+    void finish() {
+        if (drawn) std::cerr << "\r\033[K" << std::flush;
+        drawn = false;
+    }
+
+private:
+    std::string label;
+    bool enabled;
+    bool drawn = false;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point last_draw;
+};
+
+class RateScheduler {
+private:
+    struct Slot {
+        curl_off_t limit = 0;
+        curl_off_t last_bytes = 0;
+        std::chrono::steady_clock::time_point last_sample = std::chrono::steady_clock::now();
+        double rate = 0;
+    };
+
+    mutable std::mutex mutex;
+    std::map<size_t, Slot> slots;
+    size_t last_id = 0;
+    curl_off_t global_limit = 0;
+    curl_off_t transfer_limit = 0;
+    bool dirty = false;
+    std::chrono::steady_clock::time_point last_rebalance;
+
+    static constexpr curl_off_t minimum_share = 16 * 1024;
+
+    // Max-min справедливое деление: передачи, упертые не в лимит, получают чуть больше
+    // своей скорости, остаток бюджета делится поровну между остальными.
+    void rebalance() {
+        last_rebalance = std::chrono::steady_clock::now();
+        dirty = false;
+        if (global_limit <= 0) {
+            for (auto& item : slots) item.second.limit = transfer_limit;
+            return;
+        }
+        std::vector<std::pair<double, Slot*>> demands;
+        for (auto& item : slots) {
+            Slot& slot = item.second;
+            bool saturated = slot.limit <= 0 || slot.last_bytes == 0 || slot.rate >= 0.8 * (double)slot.limit;
+            double demand = saturated ? (double)global_limit : slot.rate * 1.25;
+            if (transfer_limit > 0) demand = std::min(demand, (double)transfer_limit);
+            demands.push_back({ demand, &slot });
+        }
+        std::sort(demands.begin(), demands.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        double remaining = (double)global_limit;
+        size_t left = demands.size();
+        for (auto& demand : demands) {
+            double share = remaining / (double)left--;
+            double granted = std::max(std::min(demand.first, share), (double)minimum_share);
+            demand.second->limit = (curl_off_t)granted;
+            remaining = std::max(0.0, remaining - granted);
+        }
+    }
+
+public:
+    void set_limits(curl_off_t global, curl_off_t per_transfer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        global_limit = std::max<curl_off_t>(global, 0);
+        transfer_limit = std::max<curl_off_t>(per_transfer, 0);
+        dirty = true;
+    }
+
+    curl_off_t global() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return global_limit;
+    }
+
+    curl_off_t per_transfer() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return transfer_limit;
+    }
+
+    size_t active() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return slots.size();
+    }
+
+    size_t attach() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t id = ++last_id;
+        slots[id];
+        rebalance();
+        return id;
+    }
+
+    void detach(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        slots.erase(id);
+        dirty = true;
+    }
+
+    curl_off_t update(size_t id, curl_off_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = slots.find(id);
+        if (it == slots.end()) return 0;
+        Slot& slot = it->second;
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - slot.last_sample).count();
+        if (elapsed >= 0.2) {
+            double instant = (double)(bytes - slot.last_bytes) / elapsed;
+            slot.rate = slot.rate > 0 ? 0.5 * slot.rate + 0.5 * instant : instant;
+            slot.last_bytes = bytes;
+            slot.last_sample = now;
+        }
+        if (dirty || now - last_rebalance >= std::chrono::milliseconds(250)) rebalance();
+        return slot.limit;
+    }
+};
+
+class RateTicket {
+public:
+    RateTicket(RateScheduler& scheduler, CURL *handle, bool upload)
+        : scheduler(scheduler), handle(handle), upload(upload), slot(scheduler.attach()) {
+        apply(scheduler.update(slot, 0));
+        curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progress_callback);
+        curl_easy_setopt(handle, CURLOPT_XFERINFODATA, this);
+    }
+
+    RateTicket(const RateTicket&) = delete;
+    RateTicket& operator=(const RateTicket&) = delete;
+
+    ~RateTicket() { scheduler.detach(slot); }
+
+    // Для передач, которые уже используют XFERINFOFUNCTION в своих целях.
+    void progress(curl_off_t dlnow, curl_off_t ulnow) { apply(scheduler.update(slot, upload ? ulnow : dlnow)); }
+
+    void observe(std::function<void(curl_off_t, curl_off_t)> observer) { this->observer = std::move(observer); }
+
+    void release() {
+        curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, nullptr);
+        curl_easy_setopt(handle, CURLOPT_XFERINFODATA, nullptr);
+        apply(0);
+    }
+
+private:
+    RateScheduler& scheduler;
+    CURL *handle;
+    bool upload;
+    size_t slot;
+    curl_off_t applied = -1;
+    std::function<void(curl_off_t, curl_off_t)> observer;
+
+    void apply(curl_off_t limit) {
+        if (limit == applied) return;
+        applied = limit;
+        curl_easy_setopt(handle, upload ? CURLOPT_MAX_SEND_SPEED_LARGE : CURLOPT_MAX_RECV_SPEED_LARGE, limit);
+    }
+
+    static int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+        RateTicket *ticket = (RateTicket *)clientp;
+        ticket->progress(dlnow, ulnow);
+        if (ticket->observer) ticket->upload ? ticket->observer(ultotal, ulnow) : ticket->observer(dltotal, dlnow);
+        return 0;
+    }
+};
+
+// Общие для всех easy-хэндлов клиента (сессия, пул, фоновые задания) DNS-кэш и кэш TLS-сессий:
+// новые соединения не платят за резолв и полное рукопожатие. Кэш соединений не разделяется:
+// libcurl не допускает его одновременного использования из разных потоков, а управляющее
+// соединение FTP несет состояние (CWD, TYPE, MODE). Соединения переиспользуются внутри
+// одного владельца - в кэше multi-хэндла пула и в собственном хэндле каждого фонового потока.
+class CurlShare {
+public:
+    CurlShare() {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        share = curl_share_init();
+        if (!share) return;
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+
+    CurlShare(const CurlShare&) = delete;
+    CurlShare& operator=(const CurlShare&) = delete;
+
+    // Объявляется в FtpClient первым и разрушается последним, когда хэндлов уже нет.
+    ~CurlShare() {
+        if (share) curl_share_cleanup(share);
+        curl_global_cleanup();
+    }
+
+    CURLSH *get() const { return share; }
+
+private:
+    CURLSH *share = nullptr;
+    std::mutex locks[CURL_LOCK_DATA_LAST];
+
+    static void lock(CURL *, curl_lock_data data, curl_lock_access, void *userptr) {
+        ((CurlShare *)userptr)->locks[data].lock();
+    }
+
+    static void unlock(CURL *, curl_lock_data data, void *userptr) {
+        ((CurlShare *)userptr)->locks[data].unlock();
+    }
+};
+
+class TransferPool {
+public:
+    // Число соединений 0 включает адаптивный режим (-j auto).
+    static constexpr size_t adaptive_connections = 0;
+    static constexpr unsigned max_rejected_retries = 3;
+
+    struct Job {
+        std::function<bool(CURL *)> setup;
+        std::function<void(CURL *, CURLcode)> done;
+        unsigned rejected = 0;
+    };
+
+private:
+    struct ActiveJob {
+        Job job;
+        uint64_t bytes_seen = 0;
+    };
+
+    CURLM *multi;
+    size_t max_connections;
+    bool adaptive = false;
+    ConcurrencyController controller;
+    std::function<void(CURL *)> configure_handle;
+    std::function<void(CURL *, CURLcode)> observe_finished;
+    std::function<void(const ConcurrencyController::Report&)> observe_level;
+    std::deque<Job> pending;
+    std::vector<CURL *> idle_handles;
+    std::map<CURL *, ActiveJob> active;
+
+    size_t limit() const { return adaptive ? controller.level() : max_connections; }
+
+    static uint64_t transferred_bytes(CURL *handle) {
+        curl_off_t downloaded = 0, uploaded = 0;
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+        curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+        return (uint64_t)(downloaded + uploaded);
+    }
+
+    // 530 считается отказом по числу сессий, только если с теми же учетными данными уже были успешные входы.
+    bool capacity_rejection(CURL *handle, CURLcode res) const {
+        if (res == CURLE_OK) return false;
+        long code = 0;
+        curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &code);
+        return code == 421 || (code == 530 && controller.had_success());
+    }
+
+    void sample_progress() {
+        for (auto& item : active) {
+            uint64_t bytes = transferred_bytes(item.first);
+            if (bytes > item.second.bytes_seen) controller.add_bytes(bytes - item.second.bytes_seen);
+            item.second.bytes_seen = bytes;
+        }
+    }
+
+    void report_level() {
+        if (observe_level) observe_level(controller.report());
+    }
+
+    CURL *acquire_handle() {
+        if (!idle_handles.empty()) {
+            CURL *handle = idle_handles.back();
+            idle_handles.pop_back();
+            curl_easy_reset(handle);
+            return handle;
+        }
+        return curl_easy_init();
+    }
+
+    // Снятые из очереди задания завершаются ошибкой, чтобы вызывающий учел их в итогах.
+    void fail_pending() {
+        while (!pending.empty()) {
+            Job job = std::move(pending.front());
+            pending.pop_front();
+            if (job.done) job.done(nullptr, CURLE_FAILED_INIT);
+        }
+    }
+
+    void start_pending() {
+        while (!pending.empty() && active.size() < limit()) {
+            Job job = std::move(pending.front());
+            pending.pop_front();
+            CURL *handle = acquire_handle();
+            if (!handle) {
+                if (job.done) job.done(nullptr, CURLE_FAILED_INIT);
+                continue;
+            }
+            if (configure_handle) configure_handle(handle);
+            if (!job.setup(handle)) {
+                if (job.done) job.done(handle, CURLE_FAILED_INIT);
+                idle_handles.push_back(handle);
+                continue;
+            }
+            curl_multi_add_handle(multi, handle);
+            active.emplace(handle, ActiveJob{ std::move(job), 0 });
+        }
+    }
+
+    void collect_finished() {
+        int msgs_left = 0;
+        while (CURLMsg *msg = curl_multi_info_read(multi, &msgs_left)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *handle = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, handle);
+            auto it = active.find(handle);
+            if (it == active.end()) continue;
+            Job job = std::move(it->second.job);
+            uint64_t bytes_seen = it->second.bytes_seen;
+            size_t open_connections = active.size();
+            active.erase(it);
+            if (adaptive) {
+                if (job.rejected < max_rejected_retries && capacity_rejection(handle, res)) {
+                    ++job.rejected;
+                    controller.rejected(open_connections);
+                    report_level();
+                    pending.push_front(std::move(job));
+                    idle_handles.push_back(handle);
+                    continue;
+                }
+                uint64_t bytes = transferred_bytes(handle);
+                if (bytes > bytes_seen) controller.add_bytes(bytes - bytes_seen);
+                curl_off_t pretransfer = 0, starttransfer = 0;
+                curl_easy_getinfo(handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+                curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+                controller.finished(res == CURLE_OK, starttransfer > pretransfer ? (double)(starttransfer - pretransfer) / 1e6 : 0.0);
+            }
+            if (observe_finished) observe_finished(handle, res);
+            if (job.done) job.done(handle, res);
+            idle_handles.push_back(handle);
+        }
+    }
+
+public:
+    explicit TransferPool(size_t connections = 4) : multi(nullptr), max_connections(connections ? connections : 1) {}
+
+    ~TransferPool() {
+        for (auto& item : active) {
+            curl_multi_remove_handle(multi, item.first);
+            curl_easy_cleanup(item.first);
+        }
+        for (CURL *handle : idle_handles) curl_easy_cleanup(handle);
+        if (multi) curl_multi_cleanup(multi);
+    }
+
+    TransferPool(const TransferPool&) = delete;
+    TransferPool& operator=(const TransferPool&) = delete;
+
+    // Адаптивный уровень сохраняется между вызовами и сбрасывается только reset_adaptive().
+    void set_connections(size_t connections) {
+        adaptive = connections == adaptive_connections;
+        if (!adaptive) max_connections = connections;
+    }
+    size_t connections() const { return limit(); }
+    bool is_adaptive() const { return adaptive; }
+
+    void set_adaptive_ceiling(size_t ceiling) { controller.set_ceiling(ceiling); }
+    size_t adaptive_ceiling() const { return controller.max_level(); }
+    void reset_adaptive() { controller.reset(); }
+
+    void set_level_observer(std::function<void(const ConcurrencyController::Report&)> observer) { observe_level = std::move(observer); }
+
+    void set_handle_configurator(std::function<void(CURL *)> configurator) { configure_handle = std::move(configurator); }
+
+    void set_finished_observer(std::function<void(CURL *, CURLcode)> observer) { observe_finished = std::move(observer); }
+
+    void enqueue(Job job) { pending.push_back(std::move(job)); }
+
+    bool run() {
+        if (!multi) {
+            multi = curl_multi_init();
+            if (!multi) {
+                fail_pending();
+                return false;
+            }
+        }
+        if (adaptive) controller.begin_run();
+        start_pending();
+        while (!active.empty()) {
+            int running = 0;
+            CURLMcode mc = curl_multi_perform(multi, &running);
+            if (mc == CURLM_OK && running > 0) {
+                mc = curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+            }
+            if (mc != CURLM_OK) {
+                std::cerr << "Ошибка пула передач: " << curl_multi_strerror(mc) << std::endl;
+                for (auto& item : active) {
+                    curl_multi_remove_handle(multi, item.first);
+                    if (item.second.job.done) item.second.job.done(item.first, CURLE_FAILED_INIT);
+                    idle_handles.push_back(item.first);
+                }
+                active.clear();
+                fail_pending();
+                return false;
+            }
+            if (adaptive && controller.epoch_due()) {
+                sample_progress();
+                if (controller.tick(!pending.empty())) report_level();
+            }
+            collect_finished();
+            start_pending();
+        }
+        if (adaptive) report_level();
+        return true;
+    }
+};
+
+
+class BackgroundJobs {
+public:
+    enum class State { queued, running, finished };
+
+    struct Job {
+        size_t id = 0;
+        std::string description;
+        std::function<bool(CURL *)> setup;
+        std::function<void(CURLcode)> done;
+        std::function<void(curl_off_t, curl_off_t)> progress;
+        std::atomic<State> state{State::queued};
+        std::atomic<bool> cancelled{false};
+        std::atomic<curl_off_t> transferred{0};
+        std::atomic<curl_off_t> total{0};
+        CURLcode result = CURLE_OK;
+    };
+
+private:
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable finished_signal;
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> pending;
+    std::vector<std::shared_ptr<Job>> jobs;
+    size_t max_workers = 2;
+    size_t last_id = 0;
+    bool stopping = false;
+    std::function<void(CURL *, CURLcode)> observe_finished;
+
+    static int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+        Job *job = (Job *)clientp;
+        job->total = dltotal > 0 ? dltotal : ultotal;
+        job->transferred = dlnow > 0 ? dlnow : ulnow;
+        if (job->progress) job->progress(dlnow, ulnow);
+        return job->cancelled ? 1 : 0;
+    }
+
+    void worker_loop() {
+        CURL *handle = curl_easy_init();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wakeup.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (stopping) break;
+            std::shared_ptr<Job> job = pending.front();
+            pending.pop_front();
+            job->state = State::running;
+            lock.unlock();
+
+            CURLcode res = CURLE_FAILED_INIT;
+            if (handle) {
+                curl_easy_reset(handle);
+                if (job->setup(handle)) {
+                    curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+                    curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, progress_callback);
+                    curl_easy_setopt(handle, CURLOPT_XFERINFODATA, job.get());
+                    res = curl_easy_perform(handle);
+                    if (observe_finished) observe_finished(handle, res);
+                }
+            }
+
+            lock.lock();
+            job->result = res;
+            job->state = State::finished;
+            finished_signal.notify_all();
+        }
+        if (handle) curl_easy_cleanup(handle);
+    }
+
+public:
+    BackgroundJobs() = default;
+    BackgroundJobs(const BackgroundJobs&) = delete;
+    BackgroundJobs& operator=(const BackgroundJobs&) = delete;
+
+    ~BackgroundJobs() { shutdown(); }
+
+    void set_workers(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_workers = count ? count : 1;
+    }
+
+    size_t worker_count() const { return max_workers; }
+
+    void set_finished_observer(std::function<void(CURL *, CURLcode)> observer) { observe_finished = std::move(observer); }
+
+    size_t enqueue(std::string description, std::function<bool(CURL *)> setup, std::function<void(CURLcode)> done,
+                   std::function<void(curl_off_t, curl_off_t)> progress = {}) {
+        auto job = std::make_shared<Job>();
+        job->description = std::move(description);
+        job->setup = std::move(setup);
+        job->done = std::move(done);
+        job->progress = std::move(progress);
+        std::lock_guard<std::mutex> lock(mutex);
+        job->id = ++last_id;
+        jobs.push_back(job);
+        pending.push_back(job);
+        while (workers.size() < max_workers) workers.emplace_back(&BackgroundJobs::worker_loop, this);
+        wakeup.notify_one();
+        return job->id;
+    }
+
+    std::vector<std::shared_ptr<Job>> snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs;
+    }
+
+    bool cancel(size_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& job : jobs) {
+            if (job->id != id || job->state == State::finished) continue;
+            job->cancelled = true;
+            auto queued = std::find(pending.begin(), pending.end(), job);
+            if (queued != pending.end()) {
+                pending.erase(queued);
+                job->result = CURLE_ABORTED_BY_CALLBACK;
+                job->state = State::finished;
+                finished_signal.notify_all();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // id == 0 ждет все задания
+    bool wait(size_t id) {
+        std::unique_lock<std::mutex> lock(mutex);
+        bool known = id == 0 || std::any_of(jobs.begin(), jobs.end(), [id](const auto& job) { return job->id == id; });
+        if (!known) return false;
+        finished_signal.wait(lock, [&] {
+            return std::all_of(jobs.begin(), jobs.end(), [id](const auto& job) {
+                return (id != 0 && job->id != id) || job->state == State::finished;
+            });
+        });
+        return true;
+    }
+
+    std::vector<std::shared_ptr<Job>> collect_finished() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::shared_ptr<Job>> finished;
+        auto split = std::stable_partition(jobs.begin(), jobs.end(), [](const auto& job) { return job->state != State::finished; });
+        finished.assign(split, jobs.end());
+        jobs.erase(split, jobs.end());
+        return finished;
+    }
+
+    size_t shutdown() {
+        size_t unfinished = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto& job : jobs) {
+                if (job->state == State::finished) continue;
+                job->cancelled = true;
+                ++unfinished;
+            }
+            for (auto& job : pending) {
+                job->result = CURLE_ABORTED_BY_CALLBACK;
+                job->state = State::finished;
+            }
+            pending.clear();
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+        // Завершение еще не собранных заданий (и снятых из очереди) выполняется здесь:
+        // иначе скачанный файл остался бы .part, а прерванный - без очистки.
+        for (const auto& job : collect_finished()) job->done(job->cancelled ? CURLE_ABORTED_BY_CALLBACK : job->result);
+        return unfinished;
+    }
+};
+
+class FtpClient {
+private:
+    CurlShare curl_share;
+    CURL *curl; std::string base_url; std::string user_password;
+    TransferPool transfer_pool;
+    RateScheduler rate_scheduler;
+    TransferMetrics metrics;
+    BackgroundJobs background_jobs;
+    std::map<std::string, std::string> server_features;
+    bool use_mlsd = false;
+
+    struct CachedListing {
+        std::chrono::steady_clock::time_point fetched;
+        std::vector<FtpEntry> entries;
+        time_t fetched_at = 0;
+        time_t directory_mtime = 0;
+    };
+    std::map<std::string, CachedListing> listing_cache;
+    std::chrono::seconds listing_cache_ttl{30};
+
+    // Дисковый кэш: листинги прошлых запусков поднимаются в listing_cache по одному, когда
+    // к директории обращаются впервые, и только если mtime директории в свежем листинге
+    // родителя совпал с сохраненным, а запись не старше listing_store_ttl.
+    ListingStore listing_store;
+    std::string listing_store_dir;
+    std::string listing_store_key;
+    std::string listing_origin;
+    std::chrono::seconds listing_store_ttl{86400};
+    std::set<std::string> listing_store_seen;
+    std::set<std::string> listing_store_dropped;
+    bool listing_store_dirty = false;
+
+    std::mutex session_mutex;
+    std::condition_variable keepalive_wakeup;
+    std::thread keepalive_thread;
+    bool keepalive_stop = false;
+    bool session_request_active = false;
+    std::chrono::seconds keepalive_interval{60};
+    std::chrono::steady_clock::time_point last_activity = std::chrono::steady_clock::now();
+    int reconnect_attempts = 4;
+    std::chrono::milliseconds reconnect_delay{250};
+
+    bool mmap_uploads = true;
+    bool show_progress = true;
+    long upload_buffer_size = 512 * 1024;
+    DownloadOptions download_options;
+    long use_ssl = CURLUSESSL_NONE;
+    bool verify_tls_peer = true;
+    int compression_level = 0;
+    std::string unpack_command;
+    bool mode_z_checked = false;
+    bool mode_z_accepted = false;
+    ModeZCommands mode_z_commands;
+
+    std::string ensure_trailing_slash(std::string url) { if (url.back() != '/') url += '/'; return url; }
+
+    // Имена из листинга (пробелы, '#', '%') кодируются перед подстановкой в URL; '/' сохраняется.
+    static std::string escape_path(const std::string& path) {
+        static const char hex[] = "0123456789ABCDEF";
+        std::string escaped;
+        escaped.reserve(path.size());
+        for (unsigned char c : path) {
+            if (isalnum(c) || strchr("/-._~!$&'()*+,;=:@", c)) { escaped += (char)c; continue; }
+            escaped += '%';
+            escaped += hex[c >> 4];
+            escaped += hex[c & 15];
+        }
+        return escaped;
+    }
+
+    static std::string unescape_path(const std::string& path) {
+        int length = 0;
+        char *decoded = curl_easy_unescape(nullptr, path.c_str(), (int)path.size(), &length);
+        if (!decoded) return path;
+        std::string result(decoded, (size_t)length);
+        curl_free(decoded);
+        return result;
+    }
+
+    std::string normalize_directory_url(const std::string& url) {
+        std::string normalized;
+        normalized.reserve(url.size() + 1);
+        size_t scheme = url.find("://");
+        size_t path_start = (scheme == std::string::npos) ? 0 : scheme + 3;
+        normalized.append(url, 0, path_start);
+        for (size_t i = path_start; i < url.size(); ++i) {
+            if (url[i] == '/' && !normalized.empty() && normalized.back() == '/') continue;
+            normalized += url[i];
+        }
+        return ensure_trailing_slash(normalized);
+    }
+
+    bool split_remote_url(const std::string& full_url, std::string& parent_url, std::string& name) {
+        std::string path = full_url;
+        while (!path.empty() && path.back() == '/') path.pop_back();
+        size_t slash = path.find_last_of('/');
+        if (slash == std::string::npos) return false;
+        parent_url = normalize_directory_url(path.substr(0, slash + 1));
+        name = path.substr(slash + 1);
+        return !name.empty();
+    }
+
+    static const FtpEntry* find_entry(const std::vector<FtpEntry>& entries, const std::string& name) {
+        for (const auto& entry : entries) {
+            if (entry.name == name) return &entry;
+        }
+        return nullptr;
+    }
+
+    // С включенным дисковым кэшем устаревшие листинги остаются в памяти до сохранения:
+    // их fetched_at решает, попадут ли они на диск.
+    CachedListing* find_cached_listing(const std::string& directory_url) {
+        std::string normalized = normalize_directory_url(directory_url);
+        auto it = listing_cache.find(normalized);
+        if (it == listing_cache.end()) return load_stored_listing(normalized);
+        if (std::chrono::steady_clock::now() - it->second.fetched > listing_cache_ttl) {
+            if (listing_store_dir.empty()) listing_cache.erase(it);
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    const ListingStore::Directory* stored_directory(const std::string& normalized) const {
+        if (listing_store.size() == 0 || normalized.compare(0, listing_origin.size(), listing_origin) != 0) return nullptr;
+        if (listing_store_seen.count(normalized)) return nullptr;
+        return listing_store.find(std::string_view(normalized).substr(listing_origin.size()));
+    }
+
+    // Сохраненная директория проверяется по mtime в листинге родителя, поэтому сначала
+    // ищется ближайший предок в памяти, затем цепочка под ним поднимается с диска сверху вниз.
+    CachedListing* load_stored_listing(const std::string& normalized) {
+        std::vector<std::pair<std::string, const ListingStore::Directory*>> chain;
+        const CachedListing* parent = nullptr;
+        for (std::string current = normalized; !parent;) {
+            const ListingStore::Directory* stored = stored_directory(current);
+            std::string parent_url, name;
+            if (!stored || !split_remote_url(current, parent_url, name)) return nullptr;
+            chain.emplace_back(current, stored);
+            auto it = listing_cache.find(parent_url);
+            if (it != listing_cache.end()) {
+                if (std::chrono::steady_clock::now() - it->second.fetched > listing_cache_ttl) return nullptr;
+                parent = &it->second;
+            }
+            current = parent_url;
+        }
+        CachedListing* promoted = nullptr;
+        for (auto link = chain.rbegin(); link != chain.rend() && parent; ++link) {
+            promoted = promote_stored_listing(link->first, *link->second, *parent);
+            parent = promoted;
+        }
+        return promoted;
+    }
+
+    CachedListing* promote_stored_listing(const std::string& normalized, const ListingStore::Directory& stored, const CachedListing& parent) {
+        std::string parent_url, name;
+        split_remote_url(normalized, parent_url, name);
+        listing_store_seen.insert(normalized);
+        const FtpEntry* entry = find_entry(parent.entries, unescape_path(name));
+        bool expired = time(nullptr) - stored.fetched_at >= listing_store_ttl.count();
+        if (expired || !entry || !entry->is_directory || entry->mtime != stored.directory_mtime) {
+            listing_store_dropped.insert(normalized);
+            listing_store_dirty = true;
+            return nullptr;
+        }
+        CachedListing& promoted = listing_cache[normalized];
+        promoted = { std::chrono::steady_clock::now(), listing_store.entries_of(stored), stored.fetched_at, stored.directory_mtime };
+        return &promoted;
+    }
+
+    // mtime директории берется из листинга родителя: при следующем запуске по нему
+    // решается, можно ли верить сохраненной копии.
+    void store_listing(const std::string& normalized, CachedListing fresh) {
+        fresh.fetched_at = time(nullptr);
+        std::string parent_url, name;
+        auto parent = split_remote_url(normalized, parent_url, name) ? listing_cache.find(parent_url) : listing_cache.end();
+        if (parent != listing_cache.end()) {
+            const FtpEntry* entry = find_entry(parent->second.entries, unescape_path(name));
+            if (entry) fresh.directory_mtime = entry->mtime;
+        }
+        listing_store_seen.insert(normalized);
+        listing_store_dropped.erase(normalized);
+        listing_store_dirty = true;
+        listing_cache[normalized] = std::move(fresh);
+    }
+
+    void forget_listing(const std::string& normalized) {
+        listing_cache.erase(normalized);
+        listing_store_dropped.insert(normalized);
+        listing_store_dirty = true;
+    }
+
+    static std::string default_cache_directory() {
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        if (xdg && *xdg) return std::string(xdg) + "/ftp_client";
+        const char* home = getenv("HOME");
+        return std::string(home ? home : ".") + "/.cache/ftp_client";
+    }
+
+    std::string listing_store_file() const {
+        std::string name;
+        for (char c : listing_store_key) name += isalnum(static_cast<unsigned char>(c)) || c == '.' || c == '-' ? c : '_';
+        return (fs::path(listing_store_dir) / (name + ".listing")).string();
+    }
+
+    // Ключ кэша - адрес сервера и имя пользователя: разные учетные записи видят разные деревья.
+    void open_listing_store() {
+        listing_store.close();
+        listing_store_seen.clear();
+        listing_store_dropped.clear();
+        listing_store_dirty = false;
+        if (listing_store_dir.empty() || base_url.empty()) return;
+        size_t scheme = base_url.find("://");
+        listing_origin = base_url.substr(0, base_url.find('/', scheme == std::string::npos ? 0 : scheme + 3));
+        listing_store_key = listing_origin + " " + user_password.substr(0, user_password.find(':'));
+        if (listing_store.load(listing_store_file(), listing_store_key)) {
+            std::cout << "Дисковый кэш листингов: " << listing_store.size() << " директорий" << std::endl;
+        }
+    }
+
+    // Свежие и поднятые листинги берутся из памяти, остальные записи переносятся из старого
+    // файла, если они не устарели и не были сброшены в этом сеансе.
+    void save_listing_store() {
+        if (listing_store_dir.empty() || listing_origin.empty() || !listing_store_dirty) return;
+        std::map<std::string, ListingStore::Listing> listings;
+        time_t now = time(nullptr);
+        for (const auto& cached : listing_cache) {
+            if (cached.first.compare(0, listing_origin.size(), listing_origin) != 0) continue;
+            if (now - cached.second.fetched_at >= listing_store_ttl.count()) continue;
+            listings[cached.first.substr(listing_origin.size())] = { cached.second.fetched_at, cached.second.directory_mtime, cached.second.entries };
+        }
+        for (size_t i = 0; i < listing_store.size(); ++i) {
+            const ListingStore::Directory& directory = listing_store.directory(i);
+            std::string path(listing_store.path_of(directory));
+            std::string url = listing_origin + path;
+            if (listings.count(path) || listing_cache.count(url) || listing_store_dropped.count(url)) continue;
+            if (now - directory.fetched_at >= listing_store_ttl.count()) continue;
+            listings[path] = { (time_t)directory.fetched_at, (time_t)directory.directory_mtime, listing_store.entries_of(directory) };
+        }
+        if (ListingStore::save(listing_store_file(), listing_store_key, listings)) listing_store_dirty = false;
+    }
+
+    void cache_put_entry(const std::string& full_url, const FtpEntry& entry) {
+        std::string parent_url, name;
+        if (!split_remote_url(full_url, parent_url, name)) return;
+        CachedListing* cached = find_cached_listing(parent_url);
+        if (!cached) return;
+        if (unescape_path(name) != entry.name) {
+            forget_listing(parent_url);
+            return;
+        }
+        listing_store_dirty = true;
+        for (auto& existing : cached->entries) {
+            if (existing.name == entry.name) {
+                existing = entry;
+                return;
+            }
+        }
+        cached->entries.push_back(entry);
+    }
+
+    void cache_remove_entry(const std::string& full_url) {
+        std::string parent_url, name;
+        if (!split_remote_url(full_url, parent_url, name)) return;
+        std::string directory_url = normalize_directory_url(full_url);
+        for (auto it = listing_cache.lower_bound(directory_url);
+             it != listing_cache.end() && it->first.compare(0, directory_url.size(), directory_url) == 0;) {
+            listing_store_dropped.insert(it->first);
+            it = listing_cache.erase(it);
+        }
+        listing_store_dropped.insert(directory_url);
+        listing_store_dirty = true;
+        CachedListing* cached = find_cached_listing(parent_url);
+        if (!cached) return;
+        name = unescape_path(name);
+        cached->entries.erase(std::remove_if(cached->entries.begin(), cached->entries.end(),
+                                             [&](const FtpEntry& entry) { return entry.name == name; }),
+                              cached->entries.end());
+    }
+
+    void cache_uploaded_file(const std::string& full_url, const std::string& local_file) {
+        std::string parent_url, name;
+        if (!split_remote_url(full_url, parent_url, name)) return;
+        name = unescape_path(name);
+        std::error_code ec;
+        uintmax_t size = fs::file_size(local_file, ec);
+        if (ec) {
+            forget_listing(parent_url);
+            return;
+        }
+        cache_put_entry(full_url, { name, false, size, time(nullptr), {} });
+    }
+
+    static bool is_connection_error(CURLcode res) {
+        switch (res) {
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_GOT_NOTHING:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_FTP_WEIRD_SERVER_REPLY:
+            case CURLE_FTP_ACCEPT_TIMEOUT:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Вызывается под session_mutex. Загрузка не повторяется: libcurl мог уже прочитать буфер
+    // из источника (и передать его хэшу) до обрыва, а перемотки источника нет.
+    CURLcode perform_session_request(const char* kind = nullptr, bool retry = true) {
+        CURLcode res = curl_easy_perform(curl);
+        std::chrono::milliseconds delay = reconnect_delay;
+        for (int attempt = 1; retry && attempt <= reconnect_attempts && is_connection_error(res); ++attempt) {
+            curl_off_t received = 0;
+            curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+            if (received > 0) break;
+            std::cerr << "Соединение потеряно (" << curl_easy_strerror(res) << "), повторное подключение через "
+                      << delay.count() << " мс (попытка " << attempt << " из " << reconnect_attempts << ")" << std::endl;
+            if (!wait_for_reconnect(delay)) break;
+            delay *= 2;
+            res = curl_easy_perform(curl);
+        }
+        metrics.record(curl, res, kind);
+        last_activity = std::chrono::steady_clock::now();
+        return res;
+    }
+
+    // Пауза перед повтором без удержания session_mutex; keepalive в это время не трогает
+    // настроенный для запроса дескриптор (session_request_active).
+    bool wait_for_reconnect(std::chrono::milliseconds delay) {
+        std::unique_lock<std::mutex> lock(session_mutex, std::adopt_lock);
+        session_request_active = true;
+        bool stopped = keepalive_wakeup.wait_for(lock, delay, [this] { return keepalive_stop; });
+        session_request_active = false;
+        lock.release();
+        keepalive_wakeup.notify_all();
+        return !stopped;
+    }
+
+    void keepalive_loop() {
+        std::unique_lock<std::mutex> lock(session_mutex);
+        while (!keepalive_stop) {
+            if (keepalive_interval.count() == 0 || session_request_active) {
+                keepalive_wakeup.wait(lock);
+                continue;
+            }
+            auto deadline = last_activity + keepalive_interval;
+            if (std::chrono::steady_clock::now() < deadline) {
+                keepalive_wakeup.wait_until(lock, deadline);
+                continue;
+            }
+            if (base_url.empty()) {
+                last_activity = std::chrono::steady_clock::now();
+                continue;
+            }
+            std::string responses;
+            CURLcode res = run_quote_commands(base_url, { "NOOP" }, responses);
+            if (res != CURLE_OK) {
+                std::cerr << "\nKeep-alive: " << curl_easy_strerror(res) << std::endl;
+            }
+        }
+    }
+
+    CURLcode perform_curl_operation(const std::string& url, void* write_data_ptr, size_t (*write_func)(void*, size_t, size_t, void*), long upload_mode = 0L, void* read_data_ptr = nullptr, size_t (*read_func)(void*, size_t, size_t, void*) = nullptr) {
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, write_data_ptr);
+        curl_easy_setopt(curl, CURLOPT_UPLOAD, upload_mode);
+        if (upload_mode) {
+            curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_func);
+            curl_easy_setopt(curl, CURLOPT_READDATA, read_data_ptr);
+        }
+        CURLcode res = perform_session_request(nullptr, upload_mode == 0);
+        if (upload_mode) {
+            curl_easy_setopt(curl, CURLOPT_UPLOAD, 0L);
+        }
+        return res;
+    }
+
+    // Снимок настроек сессии: фоновые задания применяют его в своих потоках.
+    struct SessionOptions {
+        std::string user_password;
+        long upload_buffer_size;
+        long use_ssl;
+        bool verify_tls_peer;
+        CURLSH *share;
+        struct curl_slist *reset_mode;
+    };
+
+    SessionOptions session_options() const {
+        return { user_password, upload_buffer_size, use_ssl, verify_tls_peer, curl_share.get(),
+                 mode_z_accepted ? mode_z_commands.reset : nullptr };
+    }
+
+    static void apply_session_options(CURL *handle, const SessionOptions& options) {
+        curl_easy_setopt(handle, CURLOPT_SHARE, options.share);
+        curl_easy_setopt(handle, CURLOPT_FTP_SKIP_PASV_IP, 1L);
+        curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(handle, CURLOPT_UPLOAD_BUFFERSIZE, options.upload_buffer_size);
+        curl_easy_setopt(handle, CURLOPT_USE_SSL, options.use_ssl);
+        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, options.verify_tls_peer ? 1L : 0L);
+        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, options.verify_tls_peer ? 2L : 0L);
+        curl_easy_setopt(handle, CURLOPT_QUOTE, options.reset_mode);
+        if (!options.user_password.empty()) { curl_easy_setopt(handle, CURLOPT_USERPWD, options.user_password.c_str()); }
+    }
+
+    void apply_session_options(CURL *handle) { apply_session_options(handle, session_options()); }
+
+    bool report_transfer_batch(size_t total, size_t succeeded, std::chrono::steady_clock::time_point started, const char* verb) {
+        std::stringstream seconds;
+        seconds << std::fixed << std::setprecision(2)
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << verb << " " << succeeded << " из " << total << " файлов за " << seconds.str()
+                  << " с (" << (transfer_pool.is_adaptive() ? "авто: " : "") << transfer_pool.connections() << " соединений)" << std::endl;
+        return succeeded == total;
+    }
+
+    // MODE Z используется, только если сжатие включено, сервер объявил его в FEAT
+    // и однажды принял пробное переключение режима; иначе передачи идут как обычно.
+    bool compression_enabled() {
+        if (compression_level <= 0 || base_url.empty()) return false;
+        auto mode = server_features.find("MODE");
+        if (mode == server_features.end() || mode->second.find_first_of("Zz") == std::string::npos) return false;
+        if (!mode_z_checked) {
+            mode_z_checked = true;
+            std::string responses;
+            mode_z_accepted = run_quote_commands(base_url, { "MODE Z", "MODE S" }, responses) == CURLE_OK;
+            if (!mode_z_accepted) std::cerr << "Сервер отклонил MODE Z, передачи идут без сжатия" << std::endl;
+            else curl_easy_setopt(curl, CURLOPT_QUOTE, mode_z_commands.reset);
+        }
+        return mode_z_accepted;
+    }
+
+    static std::string describe_compression(curl_off_t wire_bytes, curl_off_t data_bytes) {
+        return " (MODE Z: " + format_size_human((uintmax_t)wire_bytes) + " по сети вместо " + format_size_human((uintmax_t)data_bytes) + ")";
+    }
+
+    struct HashMethod {
+        HashAlgorithm algorithm;
+        std::vector<std::string> setup;
+        std::string command;
+    };
+
+    // HASH (с выбором алгоритма через OPTS HASH, если отмеченный '*' нам не подходит),
+    // иначе нестандартные XSHA256/XSHA1/XMD5/XCRC из FEAT.
+    bool choose_hash_method(HashMethod& method) const {
+        static const std::pair<const char*, HashAlgorithm> preference[] = {
+            { "SHA-256", HashAlgorithm::sha256 }, { "SHA-1", HashAlgorithm::sha1 }, { "MD5", HashAlgorithm::md5 }, { "CRC32", HashAlgorithm::crc32 }
+        };
+        auto hash = server_features.find("HASH");
+        if (hash != server_features.end()) {
+            std::string selected;
+            std::vector<std::string> offered;
+            std::stringstream list(hash->second);
+            std::string name;
+            while (std::getline(list, name, ';')) {
+                std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+                if (!name.empty() && name.back() == '*') {
+                    name.pop_back();
+                    selected = name;
+                }
+                offered.push_back(name);
+            }
+            for (const auto& candidate : preference) {
+                if (selected == candidate.first) {
+                    method = { candidate.second, {}, "HASH" };
+                    return true;
+                }
+            }
+            for (const auto& candidate : preference) {
+                if (std::find(offered.begin(), offered.end(), candidate.first) != offered.end()) {
+                    method = { candidate.second, { std::string("OPTS HASH ") + candidate.first }, "HASH" };
+                    return true;
+                }
+            }
+        }
+        static const std::pair<const char*, HashAlgorithm> legacy[] = {
+            { "XSHA256", HashAlgorithm::sha256 }, { "XSHA1", HashAlgorithm::sha1 }, { "XMD5", HashAlgorithm::md5 }, { "XCRC", HashAlgorithm::crc32 }
+        };
+        for (const auto& candidate : legacy) {
+            if (has_feature(candidate.first)) {
+                method = { candidate.second, {}, candidate.first };
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::unique_ptr<StreamHasher> start_verification(bool verify, HashMethod& method) const {
+        if (!verify) return nullptr;
+        if (!choose_hash_method(method)) {
+            std::cerr << "Сервер не поддерживает HASH/XSHA256/XMD5/XCRC, проверка контрольной суммы пропущена" << std::endl;
+            return nullptr;
+        }
+        return std::unique_ptr<StreamHasher>(new StreamHasher(method.algorithm));
+    }
+
+    bool query_remote_hash(const std::string& full_url, const HashMethod& method, std::string& digest) {
+        std::string parent_url, name;
+        if (!split_remote_url(full_url, parent_url, name)) return false;
+        std::vector<std::string> commands = method.setup;
+        commands.push_back(method.command + " " + unescape_path(name));
+        std::string responses;
+        CURLcode res = run_quote_commands(parent_url, commands, responses);
+        if (res != CURLE_OK) {
+            std::cerr << "Сервер не вернул контрольную сумму для '" << unescape_path(name) << "': " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        // HASH: "213 SHA-256 0-1234 <hex> <name>", X-команды: "250 <hex>".
+        std::string_view rest(responses), reply;
+        while (!rest.empty()) {
+            size_t eol = rest.find('\n');
+            std::string_view line = rest.substr(0, eol);
+            rest.remove_prefix(eol == std::string_view::npos ? rest.size() : eol + 1);
+            if (line.substr(0, 4) == "213 " || line.substr(0, 4) == "250 ") reply = line.substr(4);
+        }
+        std::stringstream fields{ std::string(reply) };
+        std::string field;
+        for (int index = method.command == "HASH" ? 3 : 1; index > 0 && fields >> field; --index) {}
+        std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+        if (method.algorithm == HashAlgorithm::crc32) field.erase(0, std::min(field.find_first_not_of('0'), field.size()));
+        digest = field;
+        return !digest.empty();
+    }
+
+    bool verify_checksum(const std::string& label, const std::string& full_url, const HashMethod& method, StreamHasher& hasher) {
+        std::string remote_digest;
+        if (!query_remote_hash(full_url, method, remote_digest)) return false;
+        std::string local_digest = hasher.hex();
+        std::string compared = local_digest;
+        if (method.algorithm == HashAlgorithm::crc32) compared.erase(0, std::min(compared.find_first_not_of('0'), compared.size()));
+        if (compared != remote_digest) {
+            std::cerr << "Контрольная сумма " << StreamHasher::name(method.algorithm) << " для '" << label << "' не совпадает: локально "
+                      << local_digest << ", на сервере " << remote_digest << std::endl;
+            return false;
+        }
+        std::cout << "Контрольная сумма " << StreamHasher::name(method.algorithm) << " для '" << label << "' совпадает: " << local_digest << std::endl;
+        return true;
+    }
+
+public:
+    FtpClient() : curl(nullptr) {
+        curl = curl_easy_init();
+        if (!curl) { std::cerr << "Ошибка инициализации libcurl!" << std::endl; exit(1); }
+        apply_session_options(curl);
+        transfer_pool.set_handle_configurator([this](CURL *handle) { apply_session_options(handle); });
+        transfer_pool.set_finished_observer([this](CURL *handle, CURLcode res) { metrics.record(handle, res); });
+        transfer_pool.set_level_observer([this](const ConcurrencyController::Report& report) { metrics.record_concurrency(report); });
+        background_jobs.set_finished_observer([this](CURL *handle, CURLcode res) { metrics.record(handle, res); });
+    }
+
+    ~FtpClient() {
+        size_t unfinished = background_jobs.shutdown();
+        if (unfinished > 0) std::cerr << "Прервано фоновых заданий: " << unfinished << std::endl;
+        save_listing_store();
+        {
+            std::lock_guard<std::mutex> lock(session_mutex);
+            keepalive_stop = true;
+        }
+        keepalive_wakeup.notify_all();
+        if (keepalive_thread.joinable()) keepalive_thread.join();
+        if (curl) curl_easy_cleanup(curl);
+    }
+
+    bool set_option(const std::string& name, const std::string& value) {
+        if (name == "mmap") {
+            if (value != "on" && value != "off") return false;
+            mmap_uploads = (value == "on");
+        } else if (name == "direct-io" || name == "drop-cache") {
+            if (value != "on" && value != "off") return false;
+            (name == "direct-io" ? download_options.direct_io : download_options.drop_cache) = (value == "on");
+        } else if (name == "download-buffer") {
+            uintmax_t bytes = 0;
+            if (!parse_size_value(value, bytes) || bytes == 0) return false;
+            download_options.buffer_size = (size_t)std::min<uintmax_t>(bytes, 256u << 20);
+        } else if (name == "progress") {
+            if (value != "on" && value != "off") return false;
+            show_progress = (value == "on");
+        } else if (name == "workers") {
+            size_t count = 0;
+            try { count = std::stoul(value); } catch (const std::exception&) {}
+            if (count == 0) return false;
+            background_jobs.set_workers(count);
+        } else if (name == "auto-max") {
+            size_t count = 0;
+            try { count = std::stoul(value); } catch (const std::exception&) {}
+            if (count == 0) return false;
+            transfer_pool.set_adaptive_ceiling(count);
+        } else if (name == "tls") {
+            if (value == "off") use_ssl = CURLUSESSL_NONE;
+            else if (value == "try") use_ssl = CURLUSESSL_TRY;
+            else if (value == "on") use_ssl = CURLUSESSL_ALL;
+            else return false;
+            curl_easy_setopt(curl, CURLOPT_USE_SSL, use_ssl);
+        } else if (name == "tls-verify") {
+            if (value != "on" && value != "off") return false;
+            verify_tls_peer = (value == "on");
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, verify_tls_peer ? 1L : 0L);
+            curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, verify_tls_peer ? 2L : 0L);
+        } else if (name == "compress") {
+            int level = -1;
+            if (value == "off") level = 0;
+            else if (value == "on") level = 6;
+            else if (value.size() == 1 && value[0] >= '1' && value[0] <= '9') level = value[0] - '0';
+            if (level < 0) return false;
+            compression_level = level;
+        } else if (name == "unpack") {
+            unpack_command = value == "off" ? std::string() : value;
+        } else if (name == "upload-buffer") {
+            uintmax_t bytes = 0;
+            if (!parse_size_value(value, bytes)) return false;
+            upload_buffer_size = (long)std::clamp<uintmax_t>(bytes, CURL_MAX_WRITE_SIZE, 2 * 1024 * 1024);
+            curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, upload_buffer_size);
+        } else {
+            return false;
+        }
+        show_options();
+        return true;
+    }
+
+    void show_options() const {
+        std::cout << "  mmap          " << (mmap_uploads ? "on" : "off") << std::endl;
+        std::cout << "  upload-buffer " << format_size_human((uintmax_t)upload_buffer_size) << std::endl;
+        std::cout << "  download-buffer " << format_size_human(download_options.buffer_size) << std::endl;
+        std::cout << "  direct-io     " << (download_options.direct_io ? "on" : "off") << std::endl;
+        std::cout << "  drop-cache    " << (download_options.drop_cache ? "on" : "off") << std::endl;
+        std::cout << "  workers       " << background_jobs.worker_count() << std::endl;
+        std::cout << "  auto-max      " << transfer_pool.adaptive_ceiling() << std::endl;
+        std::cout << "  progress      " << (show_progress ? "on" : "off") << std::endl;
+        std::cout << "  tls           " << (use_ssl == CURLUSESSL_ALL ? "on" : use_ssl == CURLUSESSL_TRY ? "try" : "off") << std::endl;
+        std::cout << "  tls-verify    " << (verify_tls_peer ? "on" : "off") << std::endl;
+        std::cout << "  compress      " << (compression_level == 0 ? "off" : std::to_string(compression_level));
+        if (compression_level > 0 && mode_z_checked && !mode_z_accepted) std::cout << " (сервер не поддерживает MODE Z)";
+        std::cout << std::endl;
+        std::cout << "  unpack        " << (unpack_command.empty() ? "off" : unpack_command) << std::endl;
+    }
+
+    void set_rate_limits(curl_off_t global, curl_off_t per_transfer) {
+        rate_scheduler.set_limits(global, per_transfer);
+        show_rate_limits();
+    }
+
+    void show_rate_limits() {
+        auto describe = [](curl_off_t limit) { return limit > 0 ? format_size_human((uintmax_t)limit) + "/с" : std::string("без ограничения"); };
+        std::cout << "Общая скорость:    " << describe(rate_scheduler.global()) << std::endl;
+        std::cout << "Скорость передачи: " << describe(rate_scheduler.per_transfer()) << std::endl;
+        std::cout << "Активных передач:  " << rate_scheduler.active() << std::endl;
+    }
+
+    bool dump_stats(const std::string& format, const std::string& path) {
+        if (format == "show") {
+            metrics.print();
+            return true;
+        }
+        if (format == "reset") {
+            metrics.reset();
+            std::cout << "Статистика сброшена." << std::endl;
+            return true;
+        }
+        if (format != "json" && format != "prom") return false;
+        std::ofstream file;
+        if (!path.empty()) {
+            file.open(path, std::ios::trunc);
+            if (!file) {
+                std::cerr << "Не удалось открыть файл '" << path << "'" << std::endl;
+                return true;
+            }
+        }
+        std::ostream& out = path.empty() ? std::cout : file;
+        if (format == "json") metrics.write_json(out); else metrics.write_prometheus(out);
+        if (!path.empty()) std::cout << "Статистика записана в '" << path << "'" << std::endl;
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock_session() {
+        std::unique_lock<std::mutex> lock(session_mutex);
+        last_activity = std::chrono::steady_clock::now();
+        return lock;
+    }
+
+    void set_keepalive_interval(long seconds) {
+        keepalive_interval = std::chrono::seconds(seconds > 0 ? seconds : 0);
+        keepalive_wakeup.notify_all();
+        if (keepalive_interval.count() > 0) {
+            std::cout << "Keep-alive NOOP каждые " << keepalive_interval.count() << " с простоя" << std::endl;
+        } else {
+            std::cout << "Keep-alive отключен" << std::endl;
+        }
+    }
+
+    CURLcode run_quote_commands(const std::string& directory_url, const std::vector<std::string>& commands, std::string& responses) {
+        std::string body;
+        struct curl_slist *quote = nullptr;
+        for (const auto& command : commands) quote = curl_slist_append(quote, command.c_str());
+        curl_easy_setopt(curl, CURLOPT_URL, directory_url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_POSTQUOTE, quote);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_string_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_string_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &responses);
+        CURLcode res = perform_session_request("command");
+        curl_easy_setopt(curl, CURLOPT_POSTQUOTE, nullptr);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, nullptr);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, nullptr);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+        curl_slist_free_all(quote);
+        return res;
+    }
+
+    bool probe_server_features() {
+        server_features.clear();
+        use_mlsd = false;
+        std::string responses;
+        CURLcode res = run_quote_commands(base_url, { "FEAT" }, responses);
+        if (res != CURLE_OK && res != CURLE_QUOTE_ERROR) {
+            std::cerr << "Ошибка подключения к серверу: " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+
+        std::string_view rest(responses);
+        bool in_features = false;
+        while (!rest.empty()) {
+            size_t eol = rest.find('\n');
+            std::string_view line = rest.substr(0, eol);
+            rest.remove_prefix(eol == std::string_view::npos ? rest.size() : eol + 1);
+            while (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.substr(0, 4) == "211-") { in_features = true; continue; }
+            if (line.substr(0, 4) == "211 ") { in_features = false; continue; }
+            if (!in_features || line.empty() || line[0] != ' ') continue;
+            std::string_view feature = skip_list_spaces(line);
+            size_t space = feature.find(' ');
+            std::string name(feature.substr(0, space));
+            std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+            server_features[name] = space == std::string_view::npos ? "" : std::string(feature.substr(space + 1));
+        }
+        use_mlsd = has_feature("MLST");
+        return true;
+    }
+
+    CURLcode stream_listing(const std::string& url, const ListingStreamParser::Sink& sink) {
+        curl_easy_setopt(curl, CURLOPT_DIRLISTONLY, 0L);
+        if (use_mlsd) {
+            ListingStreamParser parser(true, sink);
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "MLSD");
+            CURLcode res = perform_curl_operation(url, &parser, write_listing_callback);
+            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, nullptr);
+            if (res == CURLE_OK) parser.finish();
+            if (res != CURLE_FTP_COULDNT_RETR_FILE || parser.entries() > 0) return res;
+            std::cerr << "MLSD не поддерживается сервером, используется LIST" << std::endl;
+            use_mlsd = false;
+        }
+        ListingStreamParser parser(false, sink);
+        CURLcode res = perform_curl_operation(url, &parser, write_listing_callback);
+        if (res == CURLE_OK) parser.finish();
+        return res;
+    }
+
+    void connect(const std::string& url, const std::string& userpass) { 
+        save_listing_store();
+        base_url = ensure_trailing_slash(url);
+        user_password = userpass;
+        listing_cache.clear();
+        mode_z_checked = false;
+        mode_z_accepted = false;
+        transfer_pool.reset_adaptive();
+        curl_easy_setopt(curl, CURLOPT_QUOTE, nullptr);
+        if (!userpass.empty()) { curl_easy_setopt(curl, CURLOPT_USERPWD, user_password.c_str()); }
+        std::cout << "Установлен базовый URL: " << base_url << std::endl;
+        if (probe_server_features()) {
+            std::cout << "Формат листинга: " << (use_mlsd ? "MLSD" : "LIST") << std::endl;
+        }
+        open_listing_store();
+        if (!keepalive_thread.joinable()) keepalive_thread = std::thread(&FtpClient::keepalive_loop, this);
+    }
+
+    bool has_feature(const std::string& name) const { return server_features.count(name) > 0; }
+
+    bool list_directory(bool force_refresh = false, const ListingView& view = ListingView()) {
+        std::string directory_url = normalize_directory_url(base_url);
+        if (force_refresh) forget_listing(directory_url);
+        ListingRenderer renderer("Содержимое директории " + base_url, view);
+        bool sorted = view.sort != ListingSort::natural;
+        ListingTable table;
+        if (const CachedListing* cached = find_cached_listing(directory_url)) {
+            if (!sorted) {
+                for (const auto& entry : cached->entries) {
+                    if (!renderer.row(entry.name, entry.is_directory, entry.size, entry.mtime)) break;
+                }
+                return true;
+            }
+            table.reserve(cached->entries.size());
+            for (const auto& entry : cached->entries) table.add(entry.name, entry.is_directory, entry.size, entry.mtime);
+            renderer.render(table);
+            return true;
+        }
+
+        bool cache_enabled = listing_cache_ttl.count() > 0;
+        CachedListing fresh{ std::chrono::steady_clock::now(), {} };
+        CURLcode res = stream_listing(base_url, [&](const FtpEntryView& entry) {
+            if (sorted) table.add(entry.name, entry.is_directory, entry.size, entry.mtime);
+            else renderer.row(entry.name, entry.is_directory, entry.size, entry.mtime);
+            if (cache_enabled) fresh.entries.push_back(entry.to_entry());
+        });
+
+        if (res != CURLE_OK) {
+            renderer.discard();
+            std::cerr << "Ошибка листинга директории: " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        if (sorted) renderer.render(table);
+        if (cache_enabled) store_listing(directory_url, std::move(fresh));
+        return true;
+    }
+    
+    void change_directory(const std::string& dir_name) {
+        if (dir_name == "..") {
+            size_t last_slash = base_url.find_last_of('/', base_url.length() - 2);
+            if (last_slash != std::string::npos && last_slash > 5) { 
+                base_url = base_url.substr(0, last_slash + 1);
+                std::cout << "Директория изменена на: " << base_url << std::endl;
+                return;
+            } else if (last_slash == std::string::npos) { return; }
+        }
+        base_url = ensure_trailing_slash(base_url) + escape_path(dir_name);
+        base_url = ensure_trailing_slash(base_url);
+        std::cout << "Директория изменена на: " << base_url << std::endl;
+    }
+
+    bool download(const std::string& remote_file, const std::string& local_file, bool force_resume = false, bool verify = false) {
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(remote_file);
+        std::string partial_file = DownloadSink::partial_path(local_file);
+        TransferJournal journal;
+        bool journaled = TransferJournal::load(local_file, journal) && journal.direction == "get" && journal.url == full_url;
+        curl_off_t remote_size = -1;
+        curl_off_t resume_from = 0;
+        if (journaled || force_resume) {
+            std::error_code ec;
+            // Без .part "get -c" дописывает сам local_file; он переименовывается, только если
+            // продолжение действительно возможно, иначе DownloadSink перезаписал бы его.
+            bool adopt_local = force_resume && !fs::exists(partial_file) && fs::exists(local_file);
+            const std::string& existing = adopt_local ? local_file : partial_file;
+            uintmax_t local_size = fs::file_size(existing, ec);
+            if (!ec && local_size > 0 && query_remote_size(full_url, remote_size)) {
+                bool same_remote = !journaled || journal.total < 0 || journal.total == remote_size;
+                if (same_remote && (curl_off_t)local_size <= remote_size) resume_from = (curl_off_t)local_size;
+            }
+            if (resume_from > 0 && adopt_local) {
+                fs::rename(local_file, partial_file, ec);
+                if (ec) {
+                    std::cerr << "Не удалось переименовать '" << local_file << "': " << ec.message() << std::endl;
+                    return false;
+                }
+            }
+        }
+        journal = { "get", full_url, remote_size };
+        journal.save(local_file);
+        if (resume_from > 0) {
+            std::cout << "Продолжение скачивания '" << remote_file << "' с " << format_size_human(resume_from) << std::endl;
+        }
+
+        bool compressed = compression_enabled();
+        HashMethod hash_method;
+        std::unique_ptr<StreamHasher> hasher = start_verification(verify, hash_method);
+        if (hasher && resume_from > 0) hasher->update_from_file(partial_file, (uintmax_t)resume_from);
+        DownloadSink sink(local_file, resume_from, download_options, curl);
+        sink.set_hasher(hasher.get());
+        InflateSink inflater(sink);
+        RateTicket ticket(rate_scheduler, curl, false);
+        ProgressLine progress(remote_file, show_progress && isatty(STDERR_FILENO));
+        ticket.observe([&](curl_off_t total, curl_off_t now) { progress.update(resume_from + total, resume_from + now); });
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, resume_from);
+        if (compressed) mode_z_commands.apply(curl);
+        CURLcode res = compressed ? perform_curl_operation(full_url, &inflater, write_inflate_callback)
+                                  : perform_curl_operation(full_url, &sink, write_file_callback);
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+        curl_off_t wire_bytes = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire_bytes);
+        if (compressed) ModeZCommands::clear(curl);
+        ticket.release();
+        progress.finish();
+        if (res == CURLE_OK && compressed && !inflater.finish()) res = CURLE_BAD_CONTENT_ENCODING;
+        curl_off_t data_bytes = sink.bytes_written();
+        if (res == CURLE_OK && !sink.commit()) res = CURLE_WRITE_ERROR;
+        if (res != CURLE_OK) {
+            std::cerr << "Ошибка скачивания: " << curl_easy_strerror(res) << std::endl;
+            if (sink.abort(true)) {
+                std::cerr << "Частично скачанный файл сохранен в '" << partial_file << "', повторите 'get' для продолжения." << std::endl;
+            } else if (resume_from == 0) {
+                TransferJournal::remove(local_file);
+            }
+            return false;
+        }
+        TransferJournal::remove(local_file);
+        std::cout << "Файл '" << remote_file << "' успешно скачан в '" << local_file << "'"
+                  << (compressed ? describe_compression(wire_bytes, data_bytes) : "") << std::endl;
+        if (hasher) return verify_checksum(local_file, full_url, hash_method, *hasher);
+        return res == CURLE_OK;
+    }
+
+    bool upload(const std::string& local_file, const std::string& remote_file, bool force_resume = false, bool verify = false) {
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(remote_file);
+        std::error_code ec;
+        curl_off_t local_size = (curl_off_t)fs::file_size(local_file, ec);
+        if (ec) local_size = -1;
+
+        TransferJournal journal;
+        bool journaled = TransferJournal::load(local_file, journal) && journal.direction == "put"
+                         && journal.url == full_url && journal.total == local_size;
+        curl_off_t resume_from = 0;
+        if (journaled || force_resume) {
+            curl_off_t remote_size = 0;
+            if (query_remote_size(full_url, remote_size, false) && remote_size > 0 && remote_size <= local_size) {
+                resume_from = remote_size;
+            }
+        }
+        UploadSource source;
+        if (!source.open(local_file, resume_from, mmap_uploads)) {
+            std::cerr << "Не удалось открыть локальный файл '" << local_file << "'" << std::endl;
+            return false;
+        }
+        journal = { "put", full_url, local_size };
+        journal.save(local_file);
+        if (resume_from > 0) {
+            std::cout << "Продолжение загрузки '" << local_file << "' с " << format_size_human(resume_from) << std::endl;
+        }
+
+        bool compressed = compression_enabled();
+        HashMethod hash_method;
+        std::unique_ptr<StreamHasher> hasher = start_verification(verify, hash_method);
+        if (hasher && resume_from > 0) hasher->update_from_file(local_file, (uintmax_t)resume_from);
+        source.hasher = hasher.get();
+        curl_off_t data_bytes = source.remaining();
+        DeflateSource deflater(source, compression_level);
+        curl_easy_setopt(curl, CURLOPT_APPEND, resume_from > 0 ? 1L : 0L);
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, compressed ? (curl_off_t)-1 : source.remaining());
+        RateTicket ticket(rate_scheduler, curl, true);
+        ProgressLine progress(local_file, show_progress && isatty(STDERR_FILENO));
+        ticket.observe([&](curl_off_t total, curl_off_t now) { progress.update(resume_from + total, resume_from + now); });
+        if (compressed) mode_z_commands.apply(curl);
+        CURLcode res = compressed ? perform_curl_operation(full_url, nullptr, nullptr, 1L, &deflater, read_deflate_callback)
+                                  : perform_curl_operation(full_url, nullptr, nullptr, 1L, &source, read_callback);
+        curl_off_t wire_bytes = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &wire_bytes);
+        if (compressed) ModeZCommands::clear(curl);
+        ticket.release();
+        progress.finish();
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)-1);
+        curl_easy_setopt(curl, CURLOPT_APPEND, 0L);
+        source.close();
+        if (res != CURLE_OK) {
+            std::cerr << "Ошибка загрузки: " << curl_easy_strerror(res) << std::endl;
+            std::cerr << "Повторите 'put' для продолжения с места обрыва." << std::endl;
+            return false;
+        }
+        TransferJournal::remove(local_file);
+        cache_uploaded_file(full_url, local_file);
+        std::cout << "Файл '" << local_file << "' успешно загружен как '" << remote_file << "'"
+                  << (compressed ? describe_compression(wire_bytes, data_bytes) : "") << std::endl;
+        if (hasher && !verify_checksum(remote_file, full_url, hash_method, *hasher)) return false;
+        update_upload_index({ { local_file, remote_file } });
+        return true;
+    }
+
+    // put в дерево, которое уже зеркалировалось через rmirror, обновляет индекс этого дерева,
+    // иначе следующий rmirror загрузил бы файлы повторно. Индекс ищется вверх от каждого файла.
+    void update_upload_index(const std::vector<std::pair<std::string, std::string>>& files) {
+        struct OpenIndex {
+            std::string remote_root;
+            std::unique_ptr<UploadIndex> index;
+        };
+        std::map<std::string, OpenIndex> opened;
+        for (const auto& [local_file, remote_file] : files) {
+            struct stat st;
+            std::error_code ec;
+            fs::path local_path = fs::absolute(local_file, ec).lexically_normal();
+            if (ec || stat(local_file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            std::string remote_path = normalize_directory_url(ensure_trailing_slash(base_url) + remote_file);
+            remote_path.pop_back();
+            for (fs::path directory = local_path.parent_path(); ; directory = directory.parent_path()) {
+                std::string index_path = (directory / UploadIndex::file_name).string();
+                std::string relative = local_path.lexically_relative(directory).generic_string();
+                size_t root_length = remote_path.size() - std::min(remote_path.size(), relative.size());
+                if (root_length > 0 && remote_path[root_length - 1] == '/' && remote_path.compare(root_length, std::string::npos, relative) == 0) {
+                    std::string remote_root = remote_path.substr(0, root_length);
+                    auto found = opened.find(index_path);
+                    if (found == opened.end() && fs::exists(index_path, ec)) {
+                        std::unique_ptr<UploadIndex> index(new UploadIndex());
+                        if (index->load(index_path, remote_root)) found = opened.emplace(index_path, OpenIndex{ remote_root, std::move(index) }).first;
+                    }
+                    if (found != opened.end() && found->second.remote_root == remote_root) {
+                        LocalTreeEntry local{ false, (uintmax_t)st.st_size, st.st_mtime, st.st_mtim.tv_nsec };
+                        found->second.index->put(relative, false, local.size, local.mtime_ns(), time(nullptr), {});
+                        break;
+                    }
+                }
+                if (directory == directory.parent_path()) break;
+            }
+        }
+        for (auto& [index_path, open] : opened) open.index->save(index_path, open.remote_root, [](std::string_view) { return true; });
+    }
+
+    size_t download_async(const std::string& remote_file, const std::string& local_file) {
+        struct BackgroundDownload {
+            std::string url;
+            std::string local_file;
+            std::unique_ptr<DownloadSink> sink;
+            std::unique_ptr<RateTicket> ticket;
+        };
+        auto state = std::make_shared<BackgroundDownload>();
+        state->url = ensure_trailing_slash(base_url) + escape_path(remote_file);
+        state->local_file = local_file;
+        size_t id = background_jobs.enqueue("get " + remote_file + " -> " + local_file,
+            [this, state, session = session_options(), options = download_options](CURL *handle) {
+                apply_session_options(handle, session);
+                state->sink.reset(new DownloadSink(state->local_file, 0, options, handle));
+                state->ticket.reset(new RateTicket(rate_scheduler, handle, false));
+                curl_easy_setopt(handle, CURLOPT_URL, state->url.c_str());
+                curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_file_callback);
+                curl_easy_setopt(handle, CURLOPT_WRITEDATA, state->sink.get());
+                return true;
+            },
+            [state, remote_file](CURLcode res) {
+                state->ticket.reset();
+                if (res == CURLE_OK && state->sink && !state->sink->commit()) res = CURLE_WRITE_ERROR;
+                if (res == CURLE_ABORTED_BY_CALLBACK) {
+                    if (state->sink) state->sink->abort(false);
+                    return;
+                }
+                if (res != CURLE_OK) {
+                    bool kept = state->sink && state->sink->abort(true);
+                    std::cerr << "Ошибка скачивания '" << remote_file << "': " << curl_easy_strerror(res) << std::endl;
+                    if (kept) std::cerr << "Частично скачанный файл сохранен, 'get -c' продолжит скачивание." << std::endl;
+                    return;
+                }
+                std::cout << "Файл '" << remote_file << "' успешно скачан в '" << state->local_file << "'" << std::endl;
+            },
+            [state](curl_off_t dlnow, curl_off_t ulnow) { if (state->ticket) state->ticket->progress(dlnow, ulnow); });
+        std::cout << "[" << id << "] Скачивание '" << remote_file << "' поставлено в очередь" << std::endl;
+        return id;
+    }
+
+    size_t upload_async(const std::string& local_file, const std::string& remote_file) {
+        struct BackgroundUpload {
+            std::string url;
+            std::string local_file;
+            UploadSource source;
+            bool opened = false;
+            std::unique_ptr<RateTicket> ticket;
+        };
+        auto state = std::make_shared<BackgroundUpload>();
+        state->url = ensure_trailing_slash(base_url) + escape_path(remote_file);
+        state->local_file = local_file;
+        size_t id = background_jobs.enqueue("put " + local_file + " -> " + remote_file,
+            [this, state, session = session_options(), use_mmap = mmap_uploads](CURL *handle) {
+                apply_session_options(handle, session);
+                state->opened = state->source.open(state->local_file, 0, use_mmap);
+                if (!state->opened) return false;
+                state->ticket.reset(new RateTicket(rate_scheduler, handle, true));
+                curl_easy_setopt(handle, CURLOPT_URL, state->url.c_str());
+                curl_easy_setopt(handle, CURLOPT_UPLOAD, 1L);
+                curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, state->source.remaining());
+                curl_easy_setopt(handle, CURLOPT_READFUNCTION, read_callback);
+                curl_easy_setopt(handle, CURLOPT_READDATA, &state->source);
+                return true;
+            },
+            [this, state, remote_file](CURLcode res) {
+                state->ticket.reset();
+                state->source.close();
+                if (res == CURLE_ABORTED_BY_CALLBACK) return;
+                if (!state->opened) {
+                    std::cerr << "Не удалось открыть локальный файл '" << state->local_file << "'" << std::endl;
+                    return;
+                }
+                if (res != CURLE_OK) {
+                    std::cerr << "Ошибка загрузки '" << state->local_file << "': " << curl_easy_strerror(res) << std::endl;
+                    return;
+                }
+                cache_uploaded_file(state->url, state->local_file);
+                std::cout << "Файл '" << state->local_file << "' успешно загружен как '" << remote_file << "'" << std::endl;
+            },
+            [state](curl_off_t dlnow, curl_off_t ulnow) { if (state->ticket) state->ticket->progress(dlnow, ulnow); });
+        std::cout << "[" << id << "] Загрузка '" << local_file << "' поставлена в очередь" << std::endl;
+        return id;
+    }
+
+    void list_jobs() {
+        auto jobs = background_jobs.snapshot();
+        if (jobs.empty()) {
+            std::cout << "Фоновых заданий нет." << std::endl;
+            return;
+        }
+        for (const auto& job : jobs) {
+            const char* state = job->state == BackgroundJobs::State::queued ? "в очереди"
+                              : job->state == BackgroundJobs::State::running ? "выполняется" : "завершено";
+            std::cout << "[" << job->id << "] " << state << "  " << job->description;
+            curl_off_t total = job->total, transferred = job->transferred;
+            if (job->state == BackgroundJobs::State::running && total > 0) {
+                std::cout << "  " << format_size_human((uintmax_t)transferred) << " / " << format_size_human((uintmax_t)total)
+                          << " (" << transferred * 100 / total << "%)";
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    // Вызывается под session_mutex; на время ожидания блокировка отпускается, чтобы keepalive
+    // и завершение заданий не стояли за командой wait.
+    bool wait_job(size_t id) {
+        std::unique_lock<std::mutex> lock(session_mutex, std::adopt_lock);
+        lock.unlock();
+        bool known = background_jobs.wait(id);
+        lock.lock();
+        lock.release();
+        if (!known) {
+            std::cerr << "Нет фонового задания [" << id << "]" << std::endl;
+            return false;
+        }
+        report_finished_jobs();
+        return true;
+    }
+
+    bool cancel_job(size_t id) {
+        if (!background_jobs.cancel(id)) {
+            std::cerr << "Нет активного фонового задания [" << id << "]" << std::endl;
+            return false;
+        }
+        std::cout << "[" << id << "] Отмена запрошена" << std::endl;
+        return true;
+    }
+
+    void report_finished_jobs() {
+        for (const auto& job : background_jobs.collect_finished()) {
+            std::cout << "[" << job->id << "] " << (job->cancelled ? "Отменено: " : "Завершено: ") << job->description << std::endl;
+            job->done(job->cancelled ? CURLE_ABORTED_BY_CALLBACK : job->result);
+        }
+    }
+
+    struct TransferItem {
+        std::string url;
+        std::string local_file;
+        std::string label;
+        time_t mtime = 0;
+    };
+
+    bool download_items(const std::vector<TransferItem>& items, size_t connections,
+                        std::vector<const TransferItem*>* succeeded_items = nullptr, bool verify = false) {
+        struct PooledDownload {
+            const TransferItem* item;
+            std::unique_ptr<DownloadSink> sink;
+            std::unique_ptr<InflateSink> inflater;
+            std::unique_ptr<StreamHasher> hasher;
+            std::unique_ptr<RateTicket> ticket;
+        };
+        auto started = std::chrono::steady_clock::now();
+        size_t succeeded = 0;
+        bool compressed = compression_enabled();
+        HashMethod hash_method;
+        verify = verify && start_verification(true, hash_method);
+        std::vector<std::shared_ptr<PooledDownload>> to_verify;
+        transfer_pool.set_connections(connections);
+        for (const auto& item : items) {
+            auto state = std::make_shared<PooledDownload>();
+            state->item = &item;
+            transfer_pool.enqueue({
+                [this, state, compressed, verify, &hash_method](CURL *handle) {
+                    state->sink.reset(new DownloadSink(state->item->local_file, 0, download_options, handle));
+                    if (verify) state->hasher.reset(new StreamHasher(hash_method.algorithm));
+                    state->sink->set_hasher(state->hasher.get());
+                    state->ticket.reset(new RateTicket(rate_scheduler, handle, false));
+                    curl_easy_setopt(handle, CURLOPT_URL, state->item->url.c_str());
+                    if (compressed) {
+                        state->inflater.reset(new InflateSink(*state->sink));
+                        mode_z_commands.apply(handle);
+                        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_inflate_callback);
+                        curl_easy_setopt(handle, CURLOPT_WRITEDATA, state->inflater.get());
+                    } else {
+                        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_file_callback);
+                        curl_easy_setopt(handle, CURLOPT_WRITEDATA, state->sink.get());
+                    }
+                    return true;
+                },
+                [state, &succeeded, &to_verify, succeeded_items](CURL *, CURLcode res) {
+                    const TransferItem& item = *state->item;
+                    state->ticket.reset();
+                    if (res == CURLE_OK && state->inflater && !state->inflater->finish()) res = CURLE_BAD_CONTENT_ENCODING;
+                    if (res == CURLE_OK && state->sink && !state->sink->commit()) res = CURLE_WRITE_ERROR;
+                    if (res != CURLE_OK) {
+                        if (state->sink) state->sink->abort(false);
+                        std::cerr << "Ошибка скачивания '" << item.label << "': " << curl_easy_strerror(res) << std::endl;
+                        return;
+                    }
+                    if (item.mtime > 0) set_local_mtime(item.local_file, item.mtime);
+                    ++succeeded;
+                    if (succeeded_items) succeeded_items->push_back(&item);
+                    if (state->hasher) to_verify.push_back(state);
+                    std::cout << "Файл '" << item.label << "' успешно скачан в '" << item.local_file << "'" << std::endl;
+                }
+            });
+        }
+        transfer_pool.run();
+        for (const auto& state : to_verify) {
+            if (!verify_checksum(state->item->label, state->item->url, hash_method, *state->hasher)) --succeeded;
+        }
+        return report_transfer_batch(items.size(), succeeded, started, "Скачано");
+    }
+
+    // uploaded, если задан, вызывается сразу после каждой успешной загрузки с SHA-256 содержимого.
+    bool upload_items(const std::vector<TransferItem>& items, size_t connections,
+                      std::vector<const TransferItem*>* succeeded_items = nullptr, bool verify = false,
+                      const std::function<void(const TransferItem&, const std::string&)>& uploaded = nullptr) {
+        struct PooledUpload {
+            const TransferItem* item;
+            UploadSource source;
+            bool opened = false;
+            std::unique_ptr<DeflateSource> deflater;
+            std::unique_ptr<StreamHasher> hasher;
+            std::unique_ptr<RateTicket> ticket;
+        };
+        auto started = std::chrono::steady_clock::now();
+        size_t succeeded = 0;
+        bool compressed = compression_enabled();
+        HashMethod hash_method;
+        verify = verify && start_verification(true, hash_method);
+        bool hash_content = verify || uploaded;
+        if (!verify) hash_method.algorithm = HashAlgorithm::sha256;
+        std::vector<std::shared_ptr<PooledUpload>> to_verify;
+        transfer_pool.set_connections(connections);
+        for (const auto& item : items) {
+            auto state = std::make_shared<PooledUpload>();
+            state->item = &item;
+            transfer_pool.enqueue({
+                [this, state, compressed, hash_content, &hash_method](CURL *handle) {
+                    state->opened = state->source.open(state->item->local_file, 0, mmap_uploads);
+                    if (!state->opened) return false;
+                    if (hash_content) state->hasher.reset(new StreamHasher(hash_method.algorithm));
+                    state->source.hasher = state->hasher.get();
+                    state->ticket.reset(new RateTicket(rate_scheduler, handle, true));
+                    curl_easy_setopt(handle, CURLOPT_URL, state->item->url.c_str());
+                    curl_easy_setopt(handle, CURLOPT_UPLOAD, 1L);
+                    if (compressed) {
+                        state->deflater.reset(new DeflateSource(state->source, compression_level));
+                        mode_z_commands.apply(handle);
+                        curl_easy_setopt(handle, CURLOPT_READFUNCTION, read_deflate_callback);
+                        curl_easy_setopt(handle, CURLOPT_READDATA, state->deflater.get());
+                    } else {
+                        curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, state->source.remaining());
+                        curl_easy_setopt(handle, CURLOPT_READFUNCTION, read_callback);
+                        curl_easy_setopt(handle, CURLOPT_READDATA, &state->source);
+                    }
+                    return true;
+                },
+                [this, state, verify, &succeeded, &to_verify, succeeded_items, &uploaded](CURL *, CURLcode res) {
+                    const TransferItem& item = *state->item;
+                    state->ticket.reset();
+                    if (!state->opened) {
+                        std::cerr << "Не удалось открыть локальный файл '" << item.local_file << "'" << std::endl;
+                        return;
+                    }
+                    state->deflater.reset();
+                    state->source.close();
+                    if (res != CURLE_OK) {
+                        std::cerr << "Ошибка загрузки '" << item.label << "': " << curl_easy_strerror(res) << std::endl;
+                        return;
+                    }
+                    ++succeeded;
+                    if (succeeded_items) succeeded_items->push_back(&item);
+                    if (verify) to_verify.push_back(state);
+                    cache_uploaded_file(item.url, item.local_file);
+                    std::cout << "Файл '" << item.label << "' успешно загружен" << std::endl;
+                    if (uploaded) uploaded(item, state->hasher->kind() == HashAlgorithm::sha256 ? state->hasher->digest() : std::string());
+                }
+            });
+        }
+        transfer_pool.run();
+        for (const auto& state : to_verify) {
+            if (!verify_checksum(state->item->label, state->item->url, hash_method, *state->hasher)) --succeeded;
+        }
+        return report_transfer_batch(items.size(), succeeded, started, "Загружено");
+    }
+
+    // Аргументы mget: обычные имена передаются как есть, шаблоны раскрываются по одному
+    // листингу своей директории (обычно base_url). Размеры нужны для порядка "сначала большие".
+    bool expand_remote_names(const std::vector<std::string>& patterns, bool need_sizes,
+                             std::vector<std::pair<std::string, uintmax_t>>& names) {
+        std::map<std::string, std::vector<FtpEntry>> listings;
+        auto listing_for = [&](const std::string& directory) -> const std::vector<FtpEntry>* {
+            auto found = listings.find(directory);
+            if (found != listings.end()) return &found->second;
+            std::vector<FtpEntry> entries;
+            if (!get_listing(ensure_trailing_slash(base_url) + directory, entries)) return nullptr;
+            return &listings.emplace(directory, std::move(entries)).first->second;
+        };
+        bool ok = true;
+        for (const auto& pattern : patterns) {
+            size_t slash = pattern.rfind('/');
+            std::string directory = slash == std::string::npos ? "" : pattern.substr(0, slash + 1);
+            std::string leaf = pattern.substr(directory.size());
+            if (!GlobPattern::is_glob(leaf) && !need_sizes) {
+                names.emplace_back(pattern, 0);
+                continue;
+            }
+            const std::vector<FtpEntry>* entries = listing_for(directory);
+            if (!entries) { ok = false; continue; }
+            GlobPattern compiled(leaf);
+            size_t before = names.size();
+            for (const auto& entry : *entries) {
+                if (!entry.is_directory && compiled.matches(entry.name)) names.emplace_back(directory + entry.name, entry.size);
+            }
+            if (names.size() == before) {
+                if (!GlobPattern::is_glob(leaf)) { names.emplace_back(pattern, 0); continue; }
+                std::cerr << "Нет удаленных файлов, подходящих под '" << pattern << "'" << std::endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    static bool expand_local_names(const std::vector<std::string>& patterns, bool need_sizes,
+                                   std::vector<std::pair<std::string, uintmax_t>>& names) {
+        bool ok = true;
+        for (const auto& pattern : patterns) {
+            fs::path pattern_path(pattern);
+            std::string leaf = pattern_path.filename().string();
+            std::error_code ec;
+            if (!GlobPattern::is_glob(leaf)) {
+                names.emplace_back(pattern, need_sizes ? fs::file_size(pattern_path, ec) : 0);
+                continue;
+            }
+            fs::path directory = pattern_path.has_parent_path() ? pattern_path.parent_path() : fs::path(".");
+            GlobPattern compiled(leaf);
+            size_t before = names.size();
+            for (fs::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+                std::string name = it->path().filename().string();
+                if (!compiled.matches(name) || !it->is_regular_file(ec)) continue;
+                std::string path = pattern_path.has_parent_path() ? (directory / name).string() : name;
+                names.emplace_back(path, need_sizes ? it->file_size(ec) : 0);
+            }
+            if (names.size() == before) {
+                std::cerr << "Нет локальных файлов, подходящих под '" << pattern << "'" << std::endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    static void order_largest_first(std::vector<std::pair<std::string, uintmax_t>>& names) {
+        std::stable_sort(names.begin(), names.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    }
+
+    bool download_batch(const std::vector<std::string>& remote_files, size_t connections, bool largest_first = false, bool verify = false) {
+        std::vector<std::pair<std::string, uintmax_t>> names;
+        bool expanded = expand_remote_names(remote_files, largest_first, names);
+        if (largest_first) order_largest_first(names);
+        std::vector<TransferItem> items;
+        for (const auto& name : names) {
+            items.push_back({ ensure_trailing_slash(base_url) + escape_path(name.first), fs::path(name.first).filename().string(), name.first });
+        }
+        if (items.empty()) return false;
+        return download_items(items, connections, nullptr, verify) && expanded;
+    }
+
+    bool upload_batch(const std::vector<std::string>& local_files, size_t connections, bool largest_first = false, bool verify = false) {
+        std::vector<std::pair<std::string, uintmax_t>> names;
+        bool expanded = expand_local_names(local_files, largest_first, names);
+        if (largest_first) order_largest_first(names);
+        std::vector<TransferItem> items;
+        for (const auto& name : names) {
+            items.push_back({ ensure_trailing_slash(base_url) + escape_path(fs::path(name.first).filename().string()), name.first, name.first });
+        }
+        if (items.empty()) return false;
+        std::vector<const TransferItem*> uploaded;
+        bool ok = upload_items(items, connections, &uploaded, verify);
+        std::vector<std::pair<std::string, std::string>> files;
+        for (const TransferItem* item : uploaded) files.emplace_back(item->local_file, fs::path(item->local_file).filename().string());
+        update_upload_index(files);
+        return ok && expanded;
+    }
+
+    // Относительный путь сохраняется в архиве, если не выходит за текущую директорию.
+    static std::string tar_member_name(const std::string& local_path) {
+        fs::path path = fs::path(local_path).lexically_normal();
+        bool inside = path.is_relative();
+        for (const auto& part : path) inside = inside && part != "..";
+        return inside ? path.generic_string() : fs::path(local_path).filename().string();
+    }
+
+    // Мелкие файлы одним архивом tar в одной команде STOR вместо отдельного соединения
+    // данных на каждый файл. Распаковка - команда "set unpack", %s заменяется именем архива.
+    bool upload_packed(const std::vector<std::string>& local_files, const std::string& archive_name, bool verify = false) {
+        std::vector<std::pair<std::string, uintmax_t>> names;
+        bool expanded = expand_local_names(local_files, false, names);
+        TarSource archive;
+        for (const auto& name : names) {
+            if (!archive.add(name.first, tar_member_name(name.first))) {
+                std::cerr << "Пропущен '" << name.first << "': не обычный файл" << std::endl;
+                expanded = false;
+            }
+        }
+        if (archive.count() == 0) return false;
+
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(archive_name);
+        HashMethod hash_method;
+        std::unique_ptr<StreamHasher> hasher = start_verification(verify, hash_method);
+        archive.hasher = hasher.get();
+        curl_off_t total = archive.total_size();
+        auto started = std::chrono::steady_clock::now();
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, total);
+        RateTicket ticket(rate_scheduler, curl, true);
+        ProgressLine progress(archive_name, show_progress && isatty(STDERR_FILENO));
+        ticket.observe([&](curl_off_t, curl_off_t now) { progress.update(total, now); });
+        CURLcode res = perform_curl_operation(full_url, nullptr, nullptr, 1L, &archive, read_tar_callback);
+        ticket.release();
+        progress.finish();
+        curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)-1);
+        if (res != CURLE_OK) {
+            if (!archive.unreadable().empty()) std::cerr << "Не удалось прочитать '" << archive.unreadable() << "'" << std::endl;
+            std::cerr << "Ошибка загрузки архива '" << archive_name << "': " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        for (const auto& path : archive.changed()) {
+            std::cerr << "Файл '" << path << "' изменился во время упаковки, в архиве он может быть неполным" << std::endl;
+        }
+        cache_put_entry(full_url, { archive_name, false, (uintmax_t)total, time(nullptr), {} });
+        std::stringstream seconds;
+        seconds << std::fixed << std::setprecision(2)
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "Архив '" << archive_name << "' загружен: " << archive.count() << " файлов, "
+                  << format_size_human((uintmax_t)total) << " за " << seconds.str() << " с" << std::endl;
+        if (hasher && !verify_checksum(archive_name, full_url, hash_method, *hasher)) return false;
+        if (unpack_command.empty()) return expanded;
+
+        std::string command = unpack_command;
+        for (size_t at = command.find("%s"); at != std::string::npos; at = command.find("%s", at + archive_name.size())) {
+            command.replace(at, 2, archive_name);
+        }
+        std::string responses;
+        res = run_quote_commands(base_url, { command }, responses);
+        if (res != CURLE_OK) {
+            std::cerr << "Команда распаковки '" << command << "' не выполнена: " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        // Распаковка меняет содержимое директории на сервере.
+        forget_listing(normalize_directory_url(base_url));
+        std::cout << "Выполнено на сервере: " << command << std::endl;
+        return expanded;
+    }
+
+    using CrawlVisitor = std::function<void(const std::string& relative_path, const FtpEntry& entry, int depth)>;
+
+    // keep_listings = false для агрегирующих обходов (rdu, rfind): листинги не попадают в кэш,
+    // в памяти остается только очередь непройденных директорий.
+    bool crawl_remote_tree(const std::string& root_url, size_t parallelism, int max_depth, const CrawlVisitor& visit,
+                           bool keep_listings = true) {
+        struct PendingDirectory {
+            std::string url;
+            std::string prefix;
+            int depth;
+        };
+        struct DirectoryListing {
+            PendingDirectory directory;
+            bool machine_listing;
+            CachedListing fresh;
+            std::unique_ptr<ListingStreamParser> parser;
+        };
+
+        bool cache_enabled = keep_listings && listing_cache_ttl.count() > 0;
+        size_t failed = 0;
+        std::deque<PendingDirectory> work;
+        std::function<void()> drain;
+
+        auto visit_entry = [&](const PendingDirectory& directory, const FtpEntry& entry) {
+            if (entry.name == "." || entry.name == "..") return;
+            std::string relative = directory.prefix + entry.name;
+            int depth = directory.depth + 1;
+            visit(relative, entry, depth);
+            if (entry.is_directory && (max_depth < 0 || depth < max_depth)) {
+                work.push_back({ directory.url + entry.name + "/", relative + "/", depth });
+            }
+        };
+
+        auto enqueue_listing = [&](PendingDirectory directory) {
+            auto state = std::make_shared<DirectoryListing>();
+            state->directory = std::move(directory);
+            transfer_pool.enqueue({
+                // Состояние разбора создается при каждой попытке: пул повторяет задание после 421.
+                [&, state](CURL *handle) {
+                    state->machine_listing = use_mlsd;
+                    state->fresh = CachedListing();
+                    state->fresh.fetched = std::chrono::steady_clock::now();
+                    DirectoryListing* raw = state.get();
+                    state->parser.reset(new ListingStreamParser(state->machine_listing, [&, raw](const FtpEntryView& view) {
+                        FtpEntry entry = view.to_entry();
+                        visit_entry(raw->directory, entry);
+                        if (cache_enabled) raw->fresh.entries.push_back(std::move(entry));
+                    }));
+                    curl_easy_setopt(handle, CURLOPT_URL, state->directory.url.c_str());
+                    curl_easy_setopt(handle, CURLOPT_DIRLISTONLY, 0L);
+                    if (state->machine_listing) curl_easy_setopt(handle, CURLOPT_CUSTOMREQUEST, "MLSD");
+                    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_listing_callback);
+                    curl_easy_setopt(handle, CURLOPT_WRITEDATA, state->parser.get());
+                    return true;
+                },
+                // Поддиректории, найденные до ошибки, тоже обходятся: work разбирается на любом исходе.
+                [&, state](CURL *, CURLcode res) {
+                    bool parsed = state->parser && state->parser->entries() > 0;
+                    if (res == CURLE_FTP_COULDNT_RETR_FILE && state->machine_listing && !parsed) {
+                        if (use_mlsd) std::cerr << "MLSD не поддерживается сервером, используется LIST" << std::endl;
+                        use_mlsd = false;
+                        work.push_front(state->directory);
+                    } else if (res != CURLE_OK) {
+                        std::cerr << "Ошибка листинга директории '" << state->directory.url << "': " << curl_easy_strerror(res) << std::endl;
+                        ++failed;
+                    } else {
+                        state->parser->finish();
+                        if (cache_enabled) store_listing(normalize_directory_url(state->directory.url), std::move(state->fresh));
+                    }
+                    drain();
+                }
+            });
+        };
+
+        drain = [&]() {
+            while (!work.empty()) {
+                PendingDirectory next = std::move(work.front());
+                work.pop_front();
+                if (const CachedListing* cached = find_cached_listing(next.url)) {
+                    std::vector<FtpEntry> entries = cached->entries;
+                    for (const auto& entry : entries) visit_entry(next, entry);
+                } else {
+                    enqueue_listing(std::move(next));
+                }
+            }
+        };
+
+        transfer_pool.set_connections(parallelism);
+        work.push_back({ normalize_directory_url(root_url), "", 0 });
+        drain();
+        transfer_pool.run();
+        return failed == 0;
+    }
+
+    bool collect_remote_tree(const std::string& root_url, std::map<std::string, FtpEntry>& tree, size_t parallelism) {
+        return crawl_remote_tree(root_url, parallelism, -1, [&](const std::string& relative, const FtpEntry& entry, int) {
+            tree[relative] = entry;
+        });
+    }
+
+    bool print_remote_tree(const std::string& remote_dir, size_t parallelism, int max_depth) {
+        std::string root_url = normalize_directory_url(ensure_trailing_slash(base_url) + (remote_dir == "." ? "" : remote_dir));
+        size_t files = 0, directories = 0;
+        uintmax_t total_size = 0;
+        bool ok = crawl_remote_tree(root_url, parallelism, max_depth, [&](const std::string& relative, const FtpEntry& entry, int) {
+            if (entry.is_directory) {
+                ++directories;
+                std::cout << COLOR_DIR << relative << "/" << COLOR_RESET << "\n";
+            } else {
+                ++files;
+                total_size += entry.size;
+                std::cout << relative << "  " << COLOR_SIZE << format_size_human(entry.size) << COLOR_RESET << "\n";
+            }
+        });
+        std::cout << "Директорий: " << directories << ", файлов: " << files << ", всего " << format_size_human(total_size) << std::endl;
+        return ok;
+    }
+
+    // Суммы считаются на лету по ходу обхода; хранятся только директории до глубины display_depth.
+    bool remote_disk_usage(const std::string& remote_dir, size_t parallelism, int display_depth) {
+        struct Usage {
+            uintmax_t bytes = 0;
+            size_t files = 0;
+        };
+        std::string root_url = normalize_directory_url(ensure_trailing_slash(base_url) + (remote_dir == "." ? "" : remote_dir));
+        std::map<std::string, Usage> usage;
+        usage[""];
+        bool ok = crawl_remote_tree(root_url, parallelism, -1, [&](const std::string& relative, const FtpEntry& entry, int depth) {
+            if (entry.is_directory) {
+                if (depth <= display_depth) usage[relative];
+                return;
+            }
+            Usage& total = usage[""];
+            total.bytes += entry.size;
+            ++total.files;
+            size_t slash = relative.find('/');
+            for (int level = 1; slash != std::string::npos && level <= display_depth; ++level) {
+                Usage& directory = usage[relative.substr(0, slash)];
+                directory.bytes += entry.size;
+                ++directory.files;
+                slash = relative.find('/', slash + 1);
+            }
+        }, false);
+        for (const auto& item : usage) {
+            if (item.first.empty()) continue;
+            std::cout << std::right << std::setw(12) << format_size_human(item.second.bytes) << std::setw(10) << item.second.files
+                      << "  " << item.first << "/\n";
+        }
+        const Usage& total = usage[""];
+        std::cout << std::right << std::setw(12) << format_size_human(total.bytes) << std::setw(10) << total.files
+                  << "  " << (remote_dir.empty() ? "." : remote_dir) << " (всего)" << std::endl;
+        return ok;
+    }
+
+    struct FindFilter {
+        std::string name_glob;
+        int size_compare = 0;
+        uintmax_t size = 0;
+        int age_compare = 0;
+        double age_days = 0;
+        char type = 0;
+        int max_depth = -1;
+    };
+
+    bool remote_find(const std::string& remote_dir, const FindFilter& filter, size_t parallelism) {
+        std::string root_url = normalize_directory_url(ensure_trailing_slash(base_url) + (remote_dir == "." ? "" : remote_dir));
+        time_t now = time(nullptr);
+        size_t matches = 0;
+        GlobPattern name_pattern(filter.name_glob);
+        auto matches_filter = [&](const FtpEntry& entry) {
+            if (filter.type == 'f' && entry.is_directory) return false;
+            if (filter.type == 'd' && !entry.is_directory) return false;
+            if (!filter.name_glob.empty() && !name_pattern.matches(entry.name)) return false;
+            if (filter.size_compare != 0) {
+                if (entry.is_directory) return false;
+                if (filter.size_compare > 0 && entry.size <= filter.size) return false;
+                if (filter.size_compare < 0 && entry.size >= filter.size) return false;
+            }
+            if (filter.age_compare != 0) {
+                if (entry.mtime <= 0) return false;
+                double age = difftime(now, entry.mtime) / 86400.0;
+                if (filter.age_compare > 0 && age <= filter.age_days) return false;
+                if (filter.age_compare < 0 && age >= filter.age_days) return false;
+            }
+            return true;
+        };
+        bool ok = crawl_remote_tree(root_url, parallelism, filter.max_depth, [&](const std::string& relative, const FtpEntry& entry, int) {
+            if (!matches_filter(entry)) return;
+            ++matches;
+            if (entry.is_directory) {
+                std::cout << relative << "/\n";
+            } else {
+                std::cout << relative << "  " << format_size_human(entry.size) << "\n";
+            }
+        }, false);
+        std::cout << "Найдено: " << matches << std::endl;
+        return ok;
+    }
+
+    bool mirror(const std::string& remote_dir, const std::string& local_dir, size_t connections) {
+        std::string remote_root = normalize_directory_url(ensure_trailing_slash(base_url) + (remote_dir == "." ? "" : remote_dir));
+        std::map<std::string, FtpEntry> remote_tree;
+        if (!collect_remote_tree(remote_root, remote_tree, connections)) return false;
+
+        std::error_code ec;
+        fs::create_directories(local_dir, ec);
+        std::map<std::string, LocalTreeEntry> local_tree;
+        if (!collect_local_tree(local_dir, local_tree)) return false;
+
+        std::vector<TransferItem> items;
+        for (const auto& [relative, entry] : remote_tree) {
+            fs::path local_path = fs::path(local_dir) / relative;
+            auto local = local_tree.find(relative);
+            if (entry.is_directory) {
+                if (local == local_tree.end()) fs::create_directories(local_path, ec);
+                continue;
+            }
+            if (local != local_tree.end() && !local->second.is_directory && local->second.size == entry.size
+                && (entry.mtime == 0 || entry.mtime <= local->second.mtime + 1)) continue;
+            items.push_back({ remote_root + relative, local_path.string(), relative, entry.mtime });
+        }
+
+        std::cout << "Проверено файлов: " << remote_tree.size() << ", к скачиванию: " << items.size() << std::endl;
+        if (items.empty()) return true;
+        return download_items(items, connections);
+    }
+
+    // С индексом сервер не опрашивается: к загрузке идут только файлы, у которых изменились
+    // размер или mtime (и содержимое, если размер прежний). --full перестраивает индекс по листингу.
+    bool rmirror(const std::string& local_dir, const std::string& remote_dir, size_t connections, bool full_scan = false) {
+        std::map<std::string, LocalTreeEntry> local_tree;
+        if (!collect_local_tree(local_dir, local_tree)) return false;
+        local_tree.erase(UploadIndex::file_name);
+        local_tree.erase(std::string(UploadIndex::file_name) + ".tmp");
+
+        std::string relative_root = (remote_dir == ".") ? "" : ensure_trailing_slash(remote_dir);
+        std::string remote_root = normalize_directory_url(ensure_trailing_slash(base_url) + relative_root);
+        std::string index_path = (fs::path(local_dir) / UploadIndex::file_name).string();
+        UploadIndex index;
+        bool indexed = !full_scan && index.load(index_path, remote_root);
+        std::map<std::string, FtpEntry> remote_tree;
+        std::string responses;
+        if (!indexed && !collect_remote_tree(remote_root, remote_tree, connections)) {
+            if (relative_root.empty() || run_quote_commands(base_url, { "MKD " + remote_dir }, responses) != CURLE_OK) return false;
+            remote_tree.clear();
+        }
+
+        std::vector<std::string> new_directories;
+        std::vector<TransferItem> items;
+        for (const auto& [relative, local] : local_tree) {
+            std::string local_path = (fs::path(local_dir) / relative).string();
+            if (indexed) {
+                const UploadIndex::Record* known = index.find(relative);
+                if (local.is_directory) {
+                    // Директория могла появиться на сервере и без нас, поэтому ошибка MKD игнорируется ('*').
+                    if (!known) new_directories.push_back("*MKD " + relative_root + relative);
+                    index.put(relative, true, 0, 0, 0, {});
+                    continue;
+                }
+                if (known && !(known->flags & UploadIndex::directory_flag) && known->size == local.size) {
+                    if (known->mtime_ns == local.mtime_ns()) continue;
+                    if (known->flags & UploadIndex::digest_flag) {
+                        StreamHasher hasher(HashAlgorithm::sha256);
+                        if (hasher.update_from_file(local_path, local.size)
+                            && memcmp(hasher.digest().data(), known->sha256, sizeof(known->sha256)) == 0) {
+                            index.put(relative, false, local.size, local.mtime_ns(), known->remote_mtime, hasher.digest());
+                            continue;
+                        }
+                    }
+                }
+            } else {
+                auto remote = remote_tree.find(relative);
+                if (local.is_directory) {
+                    if (remote == remote_tree.end()) new_directories.push_back("MKD " + relative_root + relative);
+                    index.put(relative, true, 0, 0, 0, {});
+                    continue;
+                }
+                if (remote != remote_tree.end() && !remote->second.is_directory && remote->second.size == local.size
+                    && local.mtime < remote->second.mtime + listing_time_granularity(remote->second.mtime)) {
+                    index.put(relative, false, local.size, local.mtime_ns(), remote->second.mtime, {});
+                    continue;
+                }
+            }
+            items.push_back({ remote_root + relative, local_path, relative, local.mtime });
+        }
 
-    bool list_directory() {
-        std::string list_data;
-        
-        curl_easy_setopt(curl, CURLOPT_DIRLISTONLY, 0L); 
-        
-        CURLcode res = perform_curl_operation(base_url, &list_data, write_string_callback);
-        
-        if (res != CURLE_OK) {
-            std::cerr << "Ошибка листинга директории: " << curl_easy_strerror(res) << std::endl;
+        std::cout << "Проверено файлов: " << local_tree.size() << (indexed ? " (по индексу)" : "") << ", к загрузке: " << items.size() << std::endl;
+        if (!new_directories.empty() && run_quote_commands(base_url, new_directories, responses) != CURLE_OK) {
+            std::cerr << "Ошибка создания удаленных директорий" << std::endl;
             return false;
-        } else {
-            std::cout << "\n--- Содержимое директории " << base_url << " ---" << std::endl;
-            std::cout << std::left << std::setw(6) << "Тип" 
-                      << std::left << std::setw(40) << "Имя" 
-                      << std::right << std::setw(15) << "Размер" << std::endl;
-            std::cout << std::string(61, '-') << std::endl;
-
-            std::stringstream ss(list_data);
-            std::string line;
-            while(std::getline(ss, line, '\n')) {
-                if (!line.empty()) {
-                    FtpEntry entry = parse_ftp_entry(line);
-                    std::string type_str = entry.is_directory ? "DIR" : "FILE";
-                    std::string color = entry.is_directory ? COLOR_DIR : COLOR_FILE;
-
-                    std::cout << color << std::left << std::setw(6) << type_str
-                              << std::left << std::setw(40) << entry.name << COLOR_RESET;
-                    if (!entry.is_directory) {
-                        std::string size_str = format_size_human(entry.size);
-                        std::cout << COLOR_SIZE << std::right << std::setw(15) << size_str << COLOR_RESET;
-                    } else {
-                        std::cout << std::right << std::setw(15) << "-";
+        }
+
+        auto keep = [&](std::string_view relative) { return local_tree.count(std::string(relative)) > 0; };
+        bool ok = true;
+        if (!items.empty()) {
+            // Индекс пополняется по мере загрузки и периодически сбрасывается на диск, чтобы
+            // прерванный rmirror при следующем запуске не загружал уже переданные файлы заново.
+            std::vector<const TransferItem*> uploaded;
+            std::map<std::string, std::string> digests;
+            auto last_save = std::chrono::steady_clock::now();
+            ok = upload_items(items, connections, &uploaded, false, [&](const TransferItem& item, const std::string& digest) {
+                const LocalTreeEntry& local = local_tree[item.label];
+                index.put(item.label, false, local.size, local.mtime_ns(), time(nullptr), digest);
+                digests[item.label] = digest;
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_save >= std::chrono::seconds(2)) {
+                    index.save(index_path, remote_root, keep);
+                    last_save = now;
+                }
+            });
+            bool times_set = false;
+            if (has_feature("MFMT") && !uploaded.empty()) {
+                std::vector<std::string> commands;
+                for (const TransferItem* item : uploaded) {
+                    char stamp[16];
+                    struct tm tm_value;
+                    gmtime_r(&item->mtime, &tm_value);
+                    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm_value);
+                    commands.push_back(std::string("MFMT ") + stamp + " " + relative_root + item->label);
+                }
+                times_set = run_quote_commands(base_url, commands, responses) == CURLE_OK;
+                if (times_set) {
+                    for (const TransferItem* item : uploaded) {
+                        const LocalTreeEntry& local = local_tree[item->label];
+                        cache_put_entry(item->url, { fs::path(item->label).filename().string(), false, local.size, item->mtime, {} });
+                        index.put(item->label, false, local.size, local.mtime_ns(), item->mtime, digests[item->label]);
                     }
-                    std::cout << std::endl;
                 }
             }
-            std::cout << "----------------------------------------------------" << std::endl;
-            return true;
-        }
-    }
-    
-    void change_directory(const std::string& dir_name) {
-        if (dir_name == "..") {
-            size_t last_slash = base_url.find_last_of('/', base_url.length() - 2);
-            if (last_slash != std::string::npos && last_slash > 5) { 
-                base_url = base_url.substr(0, last_slash + 1);
-                std::cout << "Директория изменена на: " << base_url << std::endl;
-                return;
-            } else if (last_slash == std::string::npos) { return; }
         }
-        base_url = ensure_trailing_slash(base_url) + dir_name;
-        base_url = ensure_trailing_slash(base_url);
-        std::cout << "Директория изменена на: " << base_url << std::endl;
+        index.save(index_path, remote_root, keep);
+        return ok;
     }
 
-    bool download(const std::string& remote_file, const std::string& local_file) {
-        std::string full_url = ensure_trailing_slash(base_url) + remote_file;
-        struct FtpFile ftpfile = { local_file.c_str(), NULL };
-        CURLcode res = perform_curl_operation(full_url, &ftpfile, write_file_callback);
-        if (ftpfile.stream) fclose(ftpfile.stream);
+    bool query_remote_size(const std::string& url, curl_off_t& size, bool report_errors = true) {
+        std::string header_buffer;
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_string_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &header_buffer);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_string_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &header_buffer);
+        CURLcode res = perform_session_request("command");
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, nullptr);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, nullptr);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
         if (res != CURLE_OK) {
-            std::cerr << "Ошибка скачивания: " << curl_easy_strerror(res) << std::endl;
+            if (report_errors) std::cerr << "Ошибка получения размера '" << url << "': " << curl_easy_strerror(res) << std::endl;
             return false;
         }
-        std::cout << "Файл '" << remote_file << "' успешно скачан в '" << local_file << "'" << std::endl;
-        return res == CURLE_OK;
+        curl_off_t length = -1;
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if (length < 0) {
+            if (report_errors) std::cerr << "Сервер не сообщил размер файла '" << url << "'" << std::endl;
+            return false;
+        }
+        size = length;
+        return true;
     }
 
-    bool upload(const std::string& local_file, const std::string& remote_file) {
-        FILE *local_stream = fopen(local_file.c_str(), "rb");
-        if (!local_stream) {
-            std::cerr << "Не удалось открыть локальный файл '" << local_file << "'" << std::endl;
+    bool download_segmented(const std::string& remote_file, const std::string& local_file, size_t segments) {
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(remote_file);
+        curl_off_t remote_size = 0;
+        if (!query_remote_size(full_url, remote_size)) return false;
+
+        std::string partial_file = DownloadSink::partial_path(local_file);
+        int fd = open(partial_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Не удалось открыть локальный файл '" << local_file << "': " << strerror(errno) << std::endl;
             return false;
         }
-        std::string full_url = ensure_trailing_slash(base_url) + remote_file;
-        CURLcode res = perform_curl_operation(full_url, nullptr, nullptr, 1L, local_stream, read_callback);
-        fclose(local_stream);
-        if (res != CURLE_OK) {
-            std::cerr << "Ошибка загрузки: " << curl_easy_strerror(res) << std::endl;
+        if (remote_size > 0) {
+            int err = posix_fallocate(fd, 0, remote_size);
+            if (err != 0 && ftruncate(fd, remote_size) != 0) {
+                std::cerr << "Не удалось выделить место под '" << local_file << "': " << strerror(err) << std::endl;
+                close(fd);
+                return false;
+            }
+        }
+
+        if (segments == 0) segments = 1;
+        if ((curl_off_t)segments > remote_size) segments = remote_size > 0 ? (size_t)remote_size : 1;
+        curl_off_t chunk = remote_size / (curl_off_t)segments;
+
+        auto started = std::chrono::steady_clock::now();
+        std::vector<SegmentSink> sinks(segments);
+        std::vector<std::unique_ptr<RateTicket>> tickets(segments);
+        size_t failed = 0;
+        transfer_pool.set_connections(segments);
+        for (size_t i = 0; i < segments; ++i) {
+            curl_off_t begin = chunk * (curl_off_t)i;
+            curl_off_t end = (i + 1 == segments) ? remote_size : begin + chunk;
+            sinks[i] = { fd, begin, end };
+            std::string range = std::to_string(begin) + "-" + std::to_string(end - 1);
+            SegmentSink *sink = &sinks[i];
+            std::unique_ptr<RateTicket> *ticket = &tickets[i];
+            transfer_pool.enqueue({
+                [this, full_url, range, sink, ticket, remote_size](CURL *handle) {
+                    ticket->reset(new RateTicket(rate_scheduler, handle, false));
+                    curl_easy_setopt(handle, CURLOPT_URL, full_url.c_str());
+                    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_segment_callback);
+                    curl_easy_setopt(handle, CURLOPT_WRITEDATA, sink);
+                    if (remote_size > 0) curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+                    return true;
+                },
+                [i, ticket, &failed](CURL *, CURLcode res) {
+                    ticket->reset();
+                    if (res != CURLE_OK) {
+                        std::cerr << "Ошибка скачивания сегмента " << i + 1 << ": " << curl_easy_strerror(res) << std::endl;
+                        ++failed;
+                    }
+                }
+            });
+        }
+        transfer_pool.run();
+
+        for (const auto& sink : sinks) {
+            if (sink.offset != sink.end) ++failed;
+        }
+        struct stat st;
+        bool size_ok = fstat(fd, &st) == 0 && st.st_size == remote_size;
+        close(fd);
+        std::error_code ec;
+        if (failed > 0 || !size_ok) {
+            std::cerr << "Ошибка сегментированного скачивания '" << remote_file << "': файл получен не полностью" << std::endl;
+            fs::remove(partial_file, ec);
             return false;
         }
-        std::cout << "Файл '" << local_file << "' успешно загружен как '" << remote_file << "'" << std::endl;
-        return res == CURLE_OK;
+        fs::rename(partial_file, local_file, ec);
+        if (ec) {
+            std::cerr << "Не удалось переименовать '" << partial_file << "': " << ec.message() << std::endl;
+            return false;
+        }
+        std::stringstream seconds;
+        seconds << std::fixed << std::setprecision(2)
+                << std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << "Файл '" << remote_file << "' успешно скачан в '" << local_file << "' ("
+                  << segments << " сегментов, " << format_size_human(remote_size) << " за " << seconds.str() << " с)" << std::endl;
+        return true;
     }
 
     bool create_remote_directory(const std::string& dir_name) {
-        std::string full_url = ensure_trailing_slash(base_url) + dir_name;
-        CURLcode res;
-        curl_easy_setopt(curl, CURLOPT_URL, full_url.c_str());
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "MKD");
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(dir_name);
         std::string response_buffer;
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_string_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_buffer);
-        res = curl_easy_perform(curl);
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, nullptr);
+        CURLcode res = run_quote_commands(base_url, { "MKD " + dir_name }, response_buffer);
         if (res != CURLE_OK) {
             std::cerr << "Ошибка создания удаленной директории '" << dir_name << "': " << curl_easy_strerror(res) << std::endl;
             return false;
         }
+        cache_put_entry(full_url, { fs::path(dir_name).filename().string(), true, 0, time(nullptr), {} });
         std::cout << "Удаленная директория '" << dir_name << "' создана." << std::endl;
         return true;
     }
 
-    bool delete_remote_path(const std::string& path_name, bool is_directory) {
-        std::string full_url = ensure_trailing_slash(base_url) + path_name;
-        const char* request_type = is_directory ? "RMD" : "DELE";
+    bool create_remote_directories(const std::vector<std::string>& dir_names, size_t connections) {
+        struct PooledCommand {
+            std::string name;
+            struct curl_slist *quote = nullptr;
+            ~PooledCommand() { curl_slist_free_all(quote); }
+        };
+        auto started = std::chrono::steady_clock::now();
+        size_t succeeded = 0;
+        std::string directory_url = ensure_trailing_slash(base_url);
+        transfer_pool.set_connections(connections);
+        for (const auto& dir_name : dir_names) {
+            auto state = std::make_shared<PooledCommand>();
+            state->name = dir_name;
+            state->quote = curl_slist_append(nullptr, ("MKD " + dir_name).c_str());
+            transfer_pool.enqueue({
+                [state, directory_url](CURL *handle) {
+                    curl_easy_setopt(handle, CURLOPT_URL, directory_url.c_str());
+                    curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+                    curl_easy_setopt(handle, CURLOPT_POSTQUOTE, state->quote);
+                    return true;
+                },
+                [this, state, directory_url, &succeeded](CURL *, CURLcode res) {
+                    if (res != CURLE_OK) {
+                        std::cerr << "Ошибка создания удаленной директории '" << state->name << "': " << curl_easy_strerror(res) << std::endl;
+                        return;
+                    }
+                    ++succeeded;
+                    cache_put_entry(directory_url + state->name, { fs::path(state->name).filename().string(), true, 0, time(nullptr), {} });
+                    std::cout << "Удаленная директория '" << state->name << "' создана." << std::endl;
+                }
+            });
+        }
+        transfer_pool.run();
+        return report_transfer_batch(dir_names.size(), succeeded, started, "Создано");
+    }
+
+    // Шаг пакетного режима: однотипные get/put/mkdir, собранные планировщиком.
+    bool run_batch_group(const std::string& kind, const std::vector<std::vector<std::string>>& commands, size_t connections) {
+        if (kind == "mkdir") {
+            std::vector<std::string> names;
+            for (const auto& args : commands) names.push_back(args[1]);
+            return create_remote_directories(names, connections);
+        }
+        std::vector<TransferItem> items;
+        for (const auto& args : commands) {
+            if (kind == "get") items.push_back({ ensure_trailing_slash(base_url) + escape_path(args[1]), args[2], args[1] });
+            else items.push_back({ ensure_trailing_slash(base_url) + escape_path(args[2]), args[1], args[1] });
+        }
+        if (kind == "get") return download_items(items, connections);
+        std::vector<const TransferItem*> uploaded;
+        bool ok = upload_items(items, connections, &uploaded);
+        std::vector<std::pair<std::string, std::string>> files;
+        for (const TransferItem* item : uploaded) files.emplace_back(item->local_file, commands[item - items.data()][2]);
+        update_upload_index(files);
+        return ok;
+    }
 
-        CURLcode res;
-        curl_easy_setopt(curl, CURLOPT_URL, full_url.c_str());
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request_type);
+    bool delete_remote_path(const std::string& path_name, bool is_directory) {
+        std::string full_url = ensure_trailing_slash(base_url) + escape_path(path_name);
+        const char* request_type = is_directory ? "RMD " : "DELE ";
 
         std::string response_buffer;
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_string_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_buffer);
-
-        res = curl_easy_perform(curl);
-        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, nullptr);
+        CURLcode res = run_quote_commands(base_url, { request_type + path_name }, response_buffer);
 
         if (res != CURLE_OK) {
             std::cerr << "Ошибка удаления удаленного " << (is_directory ? "директории" : "файла") 
                       << " '" << path_name << "': " << curl_easy_strerror(res) << std::endl;
             return false;
         }
+        cache_remove_entry(full_url);
         std::cout << "Удаленный " << (is_directory ? "директория" : "файл") 
                   << " '" << path_name << "' удален(а)." << std::endl;
         return true;
     }
 
+    bool get_listing(const std::string& directory_url, std::vector<FtpEntry>& entries, bool force_refresh = false) {
+        std::string normalized = normalize_directory_url(directory_url);
+        if (force_refresh) forget_listing(normalized);
+        if (const CachedListing* cached = find_cached_listing(normalized)) {
+            entries = cached->entries;
+            return true;
+        }
+        CachedListing fresh{ std::chrono::steady_clock::now(), {} };
+        CURLcode res = stream_listing(normalized, [&](const FtpEntryView& entry) { fresh.entries.push_back(entry.to_entry()); });
+        if (res != CURLE_OK) {
+            std::cerr << "Ошибка листинга директории '" << normalized << "': " << curl_easy_strerror(res) << std::endl;
+            return false;
+        }
+        entries = fresh.entries;
+        if (listing_cache_ttl.count() > 0) store_listing(normalized, std::move(fresh));
+        return true;
+    }
+
+    void set_listing_cache_ttl(long seconds) {
+        listing_cache_ttl = std::chrono::seconds(seconds > 0 ? seconds : 0);
+        if (seconds <= 0) listing_cache.clear();
+        std::cout << "Время жизни кэша листингов: " << listing_cache_ttl.count() << " с" << std::endl;
+    }
+
+    void clear_listing_cache() {
+        listing_cache.clear();
+        if (!listing_store_dir.empty() && !listing_origin.empty()) {
+            std::error_code ec;
+            listing_store.close();
+            fs::remove(listing_store_file(), ec);
+            open_listing_store();
+        }
+        std::cout << "Кэш листингов очищен." << std::endl;
+    }
+
+    void set_listing_store(const std::string& directory) {
+        save_listing_store();
+        listing_store_dir = directory == "off" ? "" : directory == "on" ? default_cache_directory() : directory;
+        open_listing_store();
+        if (listing_store_dir.empty()) std::cout << "Дисковый кэш листингов отключен." << std::endl;
+        else std::cout << "Дисковый кэш листингов: " << listing_store_dir << ", TTL " << listing_store_ttl.count() << " с" << std::endl;
+    }
+
+    void set_listing_store_ttl(long seconds) {
+        listing_store_ttl = std::chrono::seconds(seconds > 0 ? seconds : 0);
+        std::cout << "Время жизни дискового кэша листингов: " << listing_store_ttl.count() << " с" << std::endl;
+    }
+
     std::string get_base_url() const {
         return base_url;
     }
@@ -346,14 +4876,46 @@ public:
 void display_help() {
     std::cout << "\nДоступные команды (FTP):" << std::endl;
     std::cout << "  connect <url> [user:password] - Подключиться к FTP-серверу (пример: connect ftp://demo.wftpserver.com demo:demo)" << std::endl;
-    std::cout << "  ls / dir                      - Листинг удаленной директории (подробный)" << std::endl;
+    std::cout << "                                  (ftps://host - неявный TLS, для явного FTPS: set tls on)" << std::endl;
+    std::cout << "  ls / dir [-f] [view]          - Листинг удаленной директории (подробный, -f - обновить кэш)" << std::endl;
+    std::cout << "      view: -S (по размеру), -t (по времени), --name (по имени), -n N (первые N), -l (время изменения)," << std::endl;
+    std::cout << "            --page [N] (постранично), --no-color (без цвета); пример: ls -S -n 10 - 10 самых больших" << std::endl;
     std::cout << "  cd <directory_name>           - Сменить удаленную директорию" << std::endl;
     std::cout << "  mkdir <directory_name>        - Создать удаленную директорию" << std::endl;
     std::cout << "  rm <name> <is_dir>            - Удалить удаленный файл/директорию (is_dir: 0 или 1)" << std::endl;
+    std::cout << "  cache ttl <seconds> | clear   - Время жизни кэша листингов (0 - отключить) / очистить кэш" << std::endl;
+    std::cout << "  cache disk on|off|<dir>       - Сохранять листинги на диск между запусками (по умолчанию ~/.cache/ftp_client)" << std::endl;
+    std::cout << "  cache disk-ttl <seconds>      - Время жизни дискового кэша (по умолчанию 86400)" << std::endl;
+    std::cout << "  keepalive <seconds>           - Интервал NOOP при простое соединения (0 - отключить)" << std::endl;
+    std::cout << "  set [<option> <value>]        - Показать/изменить параметры передачи (mmap, upload-buffer, download-buffer, direct-io, drop-cache, workers, progress," << std::endl;
+    std::cout << "                                  compress off|on|1-9 - сжатие MODE Z, если сервер его поддерживает," << std::endl;
+    std::cout << "                                  tls off|try|on - явный FTPS (AUTH TLS), tls-verify on|off - проверка сертификата," << std::endl;
+    std::cout << "                                  auto-max N - верхний предел соединений для -j auto, по умолчанию 32," << std::endl;
+    std::cout << "                                  unpack \"SITE UNTAR %s\"|off - команда распаковки после mput --pack)" << std::endl;
+    std::cout << "  rdu [-j N] [-d depth] [path]  - Размер удаленных поддеревьев (по умолчанию глубина 1)" << std::endl;
+    std::cout << "  rfind <path> [-name glob] [-size +N|-N] [-mtime +D|-D] [-type f|d] [-maxdepth D] [-j N]" << std::endl;
+    std::cout << "                                - Поиск на сервере (результаты выводятся по мере обхода)" << std::endl;
+    std::cout << "  mirror [-j N] <remote> <local>- Синхронизировать удаленное дерево в локальное (по размеру и времени)" << std::endl;
+    std::cout << "  rmirror [-j N] [--full] <local> <remote> - Синхронизировать локальное дерево на сервер" << std::endl;
+    std::cout << "                                  (по индексу .ftp_upload_index; --full - сверить с листингом сервера)" << std::endl;
+    std::cout << "  tree [-j N] [-d depth] [path] - Рекурсивный листинг удаленного дерева (N параллельных листингов)" << std::endl;
     std::cout << "  get <remote_file> <local_file>- Скачать файл" << std::endl;
+    std::cout << "  get --segments N <remote> <local> - Скачать файл по частям в N параллельных соединений" << std::endl;
+    std::cout << "  get -c <remote> <local>       - Продолжить прерванное скачивание" << std::endl;
     std::cout << "  put <local_file> <remote_file>- Загрузить файл" << std::endl;
+    std::cout << "  put -c <local> <remote>       - Продолжить прерванную загрузку (APPE)" << std::endl;
+    std::cout << "  get/put/mget/mput --verify    - Сверить контрольную сумму с сервером (HASH, XSHA256, XMD5, XCRC)" << std::endl;
+    std::cout << "  get/put <src> <dst> &         - Выполнить передачу в фоне" << std::endl;
+    std::cout << "  rate [total] [per-transfer]   - Ограничение скорости (пример: rate 50M 10M, 0 - без ограничения)" << std::endl;
+    std::cout << "  stats [json|prom [file]|reset]- Статистика передач: фазы соединения, задержки, скорость" << std::endl;
+    std::cout << "  jobs / wait [id] / cancel <id>- Фоновые задания: список, ожидание, отмена" << std::endl;
+    std::cout << "  mget [-j N] [-S] <file|glob>... - Скачать несколько файлов параллельно (N соединений, по умолчанию 4)" << std::endl;
+    std::cout << "  mput [-j N] [-S] <file|glob>... - Загрузить несколько файлов параллельно; glob: *.log, data_[0-9]?.csv," << std::endl;
+    std::cout << "                                  -S - сначала самые большие файлы" << std::endl;
+    std::cout << "  mput --pack <archive.tar> <file|glob>... - Загрузить файлы одним архивом tar (одна команда STOR)" << std::endl;
+    std::cout << "  -j auto (mget/mput/mirror/tree/...) - Подбирать число соединений по скорости и отказам сервера (не больше set auto-max)" << std::endl;
     std::cout << "Доступные команды (Локальные):" << std::endl;
-    std::cout << "  lls / ldir                    - Листинг локальной директории" << std::endl;
+    std::cout << "  lls / ldir [-p N] [view]      - Листинг локальной директории (-p: N параллельных statx, для сетевых ФС)" << std::endl;
     std::cout << "  lcd <directory_name>          - Сменить локальную директорию" << std::endl;
     std::cout << "  lmkdir <directory_name>       - Создать локальную директорию" << std::endl;
     std::cout << "  lrm <path>                    - Удалить локальный файл/директорию" << std::endl;
@@ -361,81 +4923,699 @@ void display_help() {
     std::cout << "Общие команды:" << std::endl;
     std::cout << "  help                          - Показать эту справку" << std::endl;
     std::cout << "  exit                          - Выйти" << std::endl;
+    std::cout << "Пакетный режим: ftp_client -b <script|-> [-e] [-j N] - выполнить команды из файла или stdin" << std::endl;
+    std::cout << "  (соседние get/put/mkdir идут параллельно через N соединений, -e - остановиться на первой ошибке)" << std::endl;
+    std::cout << "Имена с пробелами берутся в кавычки (\"my file.txt\") или экранируются (my\\ file.txt); # начинает комментарий" << std::endl;
+}
+
+// Разбор строки команды без stringstream: токены собираются в один буфер, который
+// переиспользуется между строками. Пробелы разделяют токены, "..." и '...' сохраняют
+// пробелы, \ экранирует пробел, кавычку, # и себя (остальные \ остаются для glob),
+// # в начале токена вне кавычек начинает комментарий.
+class CommandLine {
+public:
+    bool parse(std::string_view line) {
+        buffer.clear();
+        buffer.reserve(line.size());
+        spans.clear();
+        error.clear();
+        size_t i = 0;
+        while (true) {
+            while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) ++i;
+            if (i == line.size() || line[i] == '#') break;
+            size_t start = buffer.size();
+            char quote = 0;
+            for (; i < line.size(); ++i) {
+                char c = line[i];
+                bool escapable = i + 1 < line.size() && next_is_escapable(line[i + 1], quote);
+                if (c == '\\' && escapable) {
+                    buffer += line[++i];
+                } else if (quote) {
+                    if (c == quote) quote = 0; else buffer += c;
+                } else if (isspace(static_cast<unsigned char>(c))) {
+                    break;
+                } else if (c == '"' || c == '\'') {
+                    quote = c;
+                } else {
+                    buffer += c;
+                }
+            }
+            if (quote) {
+                error = std::string("незакрытая кавычка ") + quote;
+                spans.clear();
+                return false;
+            }
+            spans.emplace_back(start, buffer.size() - start);
+        }
+        return true;
+    }
+
+    size_t size() const { return spans.size(); }
+    bool empty() const { return spans.empty(); }
+    std::string_view operator[](size_t i) const { return std::string_view(buffer).substr(spans[i].first, spans[i].second); }
+    const std::string& last_error() const { return error; }
+
+    // Копирует токены в args, переиспользуя уже выделенные строки.
+    void to_args(std::vector<std::string>& args) const {
+        args.resize(spans.size());
+        for (size_t i = 0; i < spans.size(); ++i) args[i].assign((*this)[i]);
+    }
+
+private:
+    static bool next_is_escapable(char next, char quote) {
+        if (quote == '\'') return false;
+        if (quote == '"') return next == '"' || next == '\\';
+        return isspace(static_cast<unsigned char>(next)) || next == '"' || next == '\'' || next == '\\' || next == '#';
+    }
+
+    std::string buffer;
+    std::vector<std::pair<size_t, size_t>> spans;
+    std::string error;
+};
+
+bool has_flag(const std::vector<std::string>& args, const char *flag) {
+    return std::find(args.begin() + 1, args.end(), flag) != args.end();
 }
 
-std::vector<std::string> split_command(const std::string& command_line) {
-    std::stringstream ss(command_line);
-    std::string item;
-    std::vector<std::string> parts;
-    while (ss >> item) { parts.push_back(item); }
-    return parts;
+// Аргументы без флагов flags и без флагов valued вместе с их значениями; строки args не копируются.
+using ArgumentList = std::vector<const std::string*>;
+
+ArgumentList positional_args(const std::vector<std::string>& args, std::initializer_list<const char*> flags,
+                             std::initializer_list<const char*> valued = {}) {
+    ArgumentList result;
+    result.reserve(args.size());
+    auto listed = [](std::initializer_list<const char*> names, const std::string& arg) {
+        return std::any_of(names.begin(), names.end(), [&](const char *name) { return arg == name; });
+    };
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (i > 0 && listed(flags, args[i])) continue;
+        if (i > 0 && listed(valued, args[i])) { ++i; continue; }
+        result.push_back(&args[i]);
+    }
+    return result;
 }
 
-int main() {
-    FtpClient ftp_client;
-    LocalFileManager local_manager;
-    std::string command_line;
+// "-j auto" выбирает число соединений адаптивно (TransferPool::adaptive_connections).
+bool parse_connections(const std::string& text, size_t& connections) {
+    if (text == "auto") {
+        connections = TransferPool::adaptive_connections;
+        return true;
+    }
+    try { connections = std::stoul(text); } catch (const std::exception&) { return false; }
+    return connections > 0;
+}
 
-    std::cout << "Простой интерактивный FTP-клиент/Файловый менеджер (C++17 required)" << std::endl;
+bool parse_batch_args(const ArgumentList& args, size_t& connections, std::vector<std::string>& files,
+                      bool* largest_first = nullptr) {
+    connections = 4;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (largest_first && *args[i] == "-S") {
+            *largest_first = true;
+        } else if (*args[i] == "-j" && i + 1 < args.size()) {
+            if (!parse_connections(*args[++i], connections)) return false;
+        } else {
+            files.push_back(*args[i]);
+        }
+    }
+    return !files.empty();
+}
+
+bool parse_listing_option(const std::vector<std::string>& args, size_t& i, ListingView& view) {
+    try {
+        if (args[i] == "-n" && i + 1 < args.size()) {
+            view.limit = std::stoul(args[++i]);
+        } else if (args[i] == "--page") {
+            view.page_rows = ListingRenderer::terminal_rows();
+            if (i + 1 < args.size() && !args[i + 1].empty() && isdigit(static_cast<unsigned char>(args[i + 1][0]))) {
+                view.page_rows = std::stoul(args[++i]);
+            }
+        } else if (args[i] == "--no-color") {
+            view.color = false;
+        } else if (args[i] == "-S") {
+            view.sort = ListingSort::size;
+        } else if (args[i] == "-t") {
+            view.sort = ListingSort::time;
+            view.show_time = true;
+        } else if (args[i] == "--name") {
+            view.sort = ListingSort::name;
+        } else if (args[i] == "-l") {
+            view.show_time = true;
+        } else {
+            return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+enum class CommandStatus { ok, failed, exit, usage };
+
+struct CommandSpec;
+
+struct CommandContext {
+    FtpClient& ftp_client;
+    LocalFileManager& local_manager;
+    const CommandSpec& spec;
+    bool background;
+};
+
+using CommandHandler = CommandStatus (*)(CommandContext&, const std::vector<std::string>&);
+
+// Запись реестра команд: имя (псевдонимы - отдельные записи с тем же обработчиком),
+// допустимое число аргументов после имени и строка использования для ошибок.
+struct CommandSpec {
+    std::string_view name;
+    size_t min_args;
+    size_t max_args;
+    bool background;
+    std::string_view usage;
+    CommandHandler handler;
+};
+
+constexpr size_t any_args = std::numeric_limits<size_t>::max();
+
+static CommandStatus status_of(bool ok) { return ok ? CommandStatus::ok : CommandStatus::failed; }
+
+static CommandStatus command_exit(CommandContext&, const std::vector<std::string>&) { return CommandStatus::exit; }
+
+static CommandStatus command_help(CommandContext&, const std::vector<std::string>&) {
     display_help();
+    return CommandStatus::ok;
+}
 
-    while (true) {
-        std::cout << "\n" << "local:" << fs::current_path().filename().string() 
-                  << " | remote:" << fs::path(ftp_client.get_base_url()).filename().string() << "> ";
-        
-        std::getline(std::cin, command_line);
+static CommandStatus command_connect(CommandContext& context, const std::vector<std::string>& args) {
+    context.ftp_client.connect(args[1], args.size() == 3 ? args[2] : "");
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_ls(CommandContext& context, const std::vector<std::string>& args) {
+    ListingView view;
+    bool force_refresh = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-f") { force_refresh = true; }
+        else if (!parse_listing_option(args, i, view)) { return CommandStatus::usage; }
+    }
+    return status_of(context.ftp_client.list_directory(force_refresh, view));
+}
 
-        std::vector<std::string> args = split_command(command_line);
+static CommandStatus command_set(CommandContext& context, const std::vector<std::string>& args) {
+    if (args.size() == 1) {
+        context.ftp_client.show_options();
+        return CommandStatus::ok;
+    }
+    if (args.size() == 3 && context.ftp_client.set_option(args[1], args[2])) return CommandStatus::ok;
+    std::cout << "Использование: " << context.spec.usage << std::endl;
+    context.ftp_client.show_options();
+    return CommandStatus::failed;
+}
 
-        if (args.empty()) continue;
+static CommandStatus command_keepalive(CommandContext& context, const std::vector<std::string>& args) {
+    long seconds = -1;
+    try { seconds = std::stol(args[1]); } catch (const std::exception&) {}
+    if (seconds < 0) return CommandStatus::usage;
+    context.ftp_client.set_keepalive_interval(seconds);
+    return CommandStatus::ok;
+}
 
-        std::string command = args[0]; 
-        std::transform(command.begin(), command.end(), command.begin(), ::tolower);
+static CommandStatus command_cache(CommandContext& context, const std::vector<std::string>& args) {
+    if (args.size() == 3 && (args[1] == "ttl" || args[1] == "disk-ttl")) {
+        long seconds = 0;
+        try { seconds = std::stol(args[2]); } catch (const std::exception&) { return CommandStatus::usage; }
+        if (args[1] == "ttl") context.ftp_client.set_listing_cache_ttl(seconds);
+        else context.ftp_client.set_listing_store_ttl(seconds);
+    } else if (args.size() == 3 && args[1] == "disk") {
+        context.ftp_client.set_listing_store(args[2]);
+    } else if (args.size() == 2 && args[1] == "clear") {
+        context.ftp_client.clear_listing_cache();
+    } else {
+        return CommandStatus::usage;
+    }
+    return CommandStatus::ok;
+}
 
-        if (command == "exit") {
-            break;
-        } else if (command == "help") {
-            display_help();
-        } else if (command == "connect") {
-            if (args.size() >= 2) {
-                std::string userpass = (args.size() >= 3) ? args[2] : ""; 
-                ftp_client.connect(args[1], userpass); 
-            } else { std::cout << "Использование: connect <url> [user:password]" << std::endl; } 
+static CommandStatus command_cd(CommandContext& context, const std::vector<std::string>& args) {
+    context.ftp_client.change_directory(args[1]);
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_mkdir(CommandContext& context, const std::vector<std::string>& args) {
+    return status_of(context.ftp_client.create_remote_directory(args[1]));
+}
+
+static CommandStatus command_rm(CommandContext& context, const std::vector<std::string>& args) {
+    bool is_dir = (args[2] == "1" || args[2] == "true");
+    return status_of(context.ftp_client.delete_remote_path(args[1], is_dir));
+}
+
+static CommandStatus command_jobs(CommandContext& context, const std::vector<std::string>&) {
+    context.ftp_client.list_jobs();
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_stats(CommandContext& context, const std::vector<std::string>& args) {
+    if (!context.ftp_client.dump_stats(args.size() > 1 ? args[1] : "show", args.size() > 2 ? args[2] : "")) return CommandStatus::usage;
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_rate(CommandContext& context, const std::vector<std::string>& args) {
+    uintmax_t global = 0, per_transfer = 0;
+    if (args.size() == 1) {
+        context.ftp_client.show_rate_limits();
+    } else if (parse_size_value(args[1], global) && (args.size() == 2 || parse_size_value(args[2], per_transfer))) {
+        context.ftp_client.set_rate_limits((curl_off_t)global, (curl_off_t)per_transfer);
+    } else {
+        return CommandStatus::usage;
+    }
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_wait(CommandContext& context, const std::vector<std::string>& args) {
+    size_t id = 0;
+    if (args.size() == 1) return status_of(context.ftp_client.wait_job(0));
+    try { id = std::stoul(args[1]); } catch (const std::exception&) {}
+    if (id == 0) return CommandStatus::usage;
+    return status_of(context.ftp_client.wait_job(id));
+}
+
+static CommandStatus command_cancel(CommandContext& context, const std::vector<std::string>& args) {
+    size_t id = 0;
+    try { id = std::stoul(args[1]); } catch (const std::exception&) {}
+    if (id == 0) return CommandStatus::usage;
+    return status_of(context.ftp_client.cancel_job(id));
+}
+
+static CommandStatus command_get(CommandContext& context, const std::vector<std::string>& args) {
+    FtpClient& ftp_client = context.ftp_client;
+    if (context.background) {
+        if (args.size() != 3) {
+            std::cout << "Использование: get <source> <destination> &" << std::endl;
+            return CommandStatus::failed;
+        }
+        ftp_client.download_async(args[1], args[2]);
+        return CommandStatus::ok;
+    }
+    bool verify = has_flag(args, "--verify");
+    ArgumentList rest = positional_args(args, { "--verify" });
+    if (rest.size() == 3) return status_of(ftp_client.download(*rest[1], *rest[2], false, verify));
+    if (rest.size() == 4 && *rest[1] == "-c") return status_of(ftp_client.download(*rest[2], *rest[3], true, verify));
+    if (rest.size() == 5 && *rest[1] == "--segments") {
+        if (verify) {
+            std::cout << "--verify не поддерживается вместе с --segments" << std::endl;
+            return CommandStatus::failed;
+        }
+        size_t segments = 0;
+        try { segments = std::stoul(*rest[2]); } catch (const std::exception&) {}
+        if (segments == 0) {
+            std::cout << "Число сегментов должно быть положительным" << std::endl;
+            return CommandStatus::failed;
+        }
+        return status_of(ftp_client.download_segmented(*rest[3], *rest[4], segments));
+    }
+    return CommandStatus::usage;
+}
+
+static CommandStatus command_put(CommandContext& context, const std::vector<std::string>& args) {
+    FtpClient& ftp_client = context.ftp_client;
+    if (context.background) {
+        if (args.size() != 3) {
+            std::cout << "Использование: put <source> <destination> &" << std::endl;
+            return CommandStatus::failed;
+        }
+        ftp_client.upload_async(args[1], args[2]);
+        return CommandStatus::ok;
+    }
+    bool verify = has_flag(args, "--verify");
+    ArgumentList rest = positional_args(args, { "--verify" });
+    if (rest.size() == 3) return status_of(ftp_client.upload(*rest[1], *rest[2], false, verify));
+    if (rest.size() == 4 && *rest[1] == "-c") return status_of(ftp_client.upload(*rest[2], *rest[3], true, verify));
+    return CommandStatus::usage;
+}
+
+static CommandStatus command_mget(CommandContext& context, const std::vector<std::string>& args) {
+    size_t connections;
+    std::vector<std::string> files;
+    bool largest_first = false;
+    bool verify = has_flag(args, "--verify");
+    std::string archive;
+    auto pack = std::find(args.begin() + 1, args.end(), "--pack");
+    if (pack != args.end()) {
+        if (context.spec.name != "mput" || pack + 1 == args.end()) return CommandStatus::usage;
+        archive = *(pack + 1);
+    }
+    if (!parse_batch_args(positional_args(args, { "--verify" }, { "--pack" }), connections, files, &largest_first)) return CommandStatus::usage;
+    if (!archive.empty()) return status_of(context.ftp_client.upload_packed(files, archive, verify));
+    if (context.spec.name == "mget") return status_of(context.ftp_client.download_batch(files, connections, largest_first, verify));
+    return status_of(context.ftp_client.upload_batch(files, connections, largest_first, verify));
+}
+
+static CommandStatus command_mirror(CommandContext& context, const std::vector<std::string>& args) {
+    size_t connections;
+    std::vector<std::string> paths;
+    bool full_scan = context.spec.name == "rmirror" && has_flag(args, "--full");
+    ArgumentList rest = full_scan ? positional_args(args, { "--full" }) : positional_args(args, {});
+    if (!parse_batch_args(rest, connections, paths) || paths.size() != 2) return CommandStatus::usage;
+    if (context.spec.name == "mirror") return status_of(context.ftp_client.mirror(paths[0], paths[1], connections));
+    return status_of(context.ftp_client.rmirror(paths[0], paths[1], connections, full_scan));
+}
+
+static CommandStatus command_tree(CommandContext& context, const std::vector<std::string>& args) {
+    size_t connections = 4;
+    int depth = -1;
+    std::string path = ".";
+    for (size_t i = 1; i < args.size(); ++i) {
+        try {
+            if (args[i] == "-j" && i + 1 < args.size()) { if (!parse_connections(args[++i], connections)) return CommandStatus::usage; }
+            else if (args[i] == "-d" && i + 1 < args.size()) { depth = std::stoi(args[++i]); }
+            else { path = args[i]; }
+        } catch (const std::exception&) { return CommandStatus::usage; }
+    }
+    return status_of(context.ftp_client.print_remote_tree(path, connections, depth));
+}
+
+static CommandStatus command_rdu(CommandContext& context, const std::vector<std::string>& args) {
+    size_t connections = 4;
+    int depth = 1;
+    std::string path = ".";
+    for (size_t i = 1; i < args.size(); ++i) {
+        try {
+            if (args[i] == "-j" && i + 1 < args.size()) { if (!parse_connections(args[++i], connections)) return CommandStatus::usage; }
+            else if (args[i] == "-d" && i + 1 < args.size()) { depth = std::stoi(args[++i]); if (depth < 0) return CommandStatus::usage; }
+            else { path = args[i]; }
+        } catch (const std::exception&) { return CommandStatus::usage; }
+    }
+    return status_of(context.ftp_client.remote_disk_usage(path, connections, depth));
+}
+
+static CommandStatus command_rfind(CommandContext& context, const std::vector<std::string>& args) {
+    FtpClient::FindFilter filter;
+    size_t connections = 4;
+    bool valid = true;
+    for (size_t i = 2; i < args.size() && valid; ++i) {
+        if (i + 1 >= args.size()) { valid = false; break; }
+        const std::string& option = args[i];
+        std::string value = args[++i];
+        try {
+            if (option == "-name") { filter.name_glob = value; }
+            else if (option == "-type") { valid = value == "f" || value == "d"; filter.type = value[0]; }
+            else if (option == "-j") { valid = parse_connections(value, connections); }
+            else if (option == "-maxdepth") { filter.max_depth = std::stoi(value); }
+            else if (option == "-size" || option == "-mtime") {
+                int compare = value[0] == '+' ? 1 : value[0] == '-' ? -1 : 0;
+                if (compare == 0) { valid = false; break; }
+                value.erase(0, 1);
+                if (option == "-size") { filter.size_compare = compare; valid = parse_size_value(value, filter.size); }
+                else { filter.age_compare = compare; filter.age_days = std::stod(value); }
+            }
+            else { valid = false; }
+        } catch (const std::exception&) { valid = false; }
+    }
+    if (!valid) return CommandStatus::usage;
+    return status_of(context.ftp_client.remote_find(args[1], filter, connections));
+}
+
+static CommandStatus command_lls(CommandContext& context, const std::vector<std::string>& args) {
+    ListingView view;
+    size_t stat_threads = 1;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-p" && i + 1 < args.size()) {
+            try { stat_threads = std::stoul(args[++i]); } catch (const std::exception&) { stat_threads = 0; }
+            if (stat_threads == 0) return CommandStatus::usage;
+        } else if (!parse_listing_option(args, i, view)) {
+            return CommandStatus::usage;
+        }
+    }
+    context.local_manager.list_directory(stat_threads, view);
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_lcd(CommandContext& context, const std::vector<std::string>& args) {
+    context.local_manager.change_directory(args[1]);
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_lmkdir(CommandContext& context, const std::vector<std::string>& args) {
+    context.local_manager.create_directory(args[1]);
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_lrm(CommandContext& context, const std::vector<std::string>& args) {
+    context.local_manager.remove_path(args[1]);
+    return CommandStatus::ok;
+}
+
+static CommandStatus command_lmv(CommandContext& context, const std::vector<std::string>& args) {
+    context.local_manager.move_path(args[1], args[2]);
+    return CommandStatus::ok;
+}
+
+// Таблица отсортирована по имени: поиск - двоичный, порядок проверяется при компиляции.
+constexpr CommandSpec command_table[] = {
+    { "cache",     1, 2,        false, "cache ttl <seconds> | cache disk on|off|<dir> | cache disk-ttl <seconds> | cache clear", command_cache },
+    { "cancel",    1, 1,        false, "cancel <id>", command_cancel },
+    { "cd",        1, 1,        false, "cd <directory_name>", command_cd },
+    { "connect",   1, 2,        false, "connect <url> [user:password]", command_connect },
+    { "dir",       0, any_args, false, "dir [-f] [-S|-t|--name] [-n N] [-l] [--page [N]] [--no-color]", command_ls },
+    { "exit",      0, any_args, false, "exit", command_exit },
+    { "get",       2, any_args, true,  "get [-c | --segments N] [--verify] <remote_file> <local_file>", command_get },
+    { "help",      0, any_args, false, "help", command_help },
+    { "jobs",      0, any_args, false, "jobs", command_jobs },
+    { "keepalive", 1, 1,        false, "keepalive <seconds>", command_keepalive },
+    { "lcd",       1, 1,        false, "lcd <directory_name>", command_lcd },
+    { "ldir",      0, any_args, false, "ldir [-p N] [-S|-t|--name] [-n N] [-l] [--page [N]] [--no-color]", command_lls },
+    { "lls",       0, any_args, false, "lls [-p N] [-S|-t|--name] [-n N] [-l] [--page [N]] [--no-color]", command_lls },
+    { "lmkdir",    1, 1,        false, "lmkdir <directory_name>", command_lmkdir },
+    { "lmv",       2, 2,        false, "lmv <from_path> <to_path>", command_lmv },
+    { "lrm",       1, 1,        false, "lrm <path>", command_lrm },
+    { "ls",        0, any_args, false, "ls [-f] [-S|-t|--name] [-n N] [-l] [--page [N]] [--no-color]", command_ls },
+    { "mget",      1, any_args, false, "mget [-j N] [-S] [--verify] <file|glob>...", command_mget },
+    { "mirror",    2, any_args, false, "mirror [-j N] <source> <destination>", command_mirror },
+    { "mkdir",     1, 1,        false, "mkdir <directory_name>", command_mkdir },
+    { "mput",      1, any_args, false, "mput [-j N] [-S] [--verify] [--pack <archive.tar>] <file|glob>...", command_mget },
+    { "put",       2, any_args, true,  "put [-c] [--verify] <local_file> <remote_file>", command_put },
+    { "rate",      0, 2,        false, "rate [total] [per-transfer]", command_rate },
+    { "rdu",       0, any_args, false, "rdu [-j N] [-d depth] [path]", command_rdu },
+    { "rfind",     1, any_args, false, "rfind <path> [-name glob] [-size +N|-N] [-mtime +D|-D] [-type f|d] [-maxdepth D] [-j N]", command_rfind },
+    { "rm",        2, 2,        false, "rm <name> <is_dir(0|1)>", command_rm },
+    { "rmirror",   2, any_args, false, "rmirror [-j N] [--full] <source> <destination>", command_mirror },
+    { "set",       0, 2,        false, "set <option> <value>", command_set },
+    { "stats",     0, 2,        false, "stats [json|prom [file]|reset]", command_stats },
+    { "tree",      0, any_args, false, "tree [-j N] [-d depth] [path]", command_tree },
+    { "wait",      0, 1,        false, "wait [id]", command_wait },
+};
+
+constexpr bool command_table_sorted() {
+    for (size_t i = 1; i < std::size(command_table); ++i) {
+        if (!(command_table[i - 1].name < command_table[i].name)) return false;
+    }
+    return true;
+}
+static_assert(command_table_sorted(), "command_table должна быть отсортирована по имени");
+
+// Имена команд не длиннее 15 символов, поэтому регистр приводится в буфере на стеке.
+const CommandSpec* find_command(std::string_view name) {
+    char lowered[16];
+    if (name.size() >= sizeof(lowered)) return nullptr;
+    for (size_t i = 0; i < name.size(); ++i) lowered[i] = (char)tolower(static_cast<unsigned char>(name[i]));
+    std::string_view key(lowered, name.size());
+    const CommandSpec* end = std::end(command_table);
+    const CommandSpec* found = std::lower_bound(std::begin(command_table), end, key,
+                                                [](const CommandSpec& spec, std::string_view value) { return spec.name < value; });
+    return found != end && found->name == key ? found : nullptr;
+}
+
+CommandStatus run_command(FtpClient& ftp_client, LocalFileManager& local_manager, const std::vector<std::string>& line) {
+    const CommandSpec* spec = find_command(line[0]);
+    if (!spec) {
+        std::cout << "Неизвестная команда. Введите 'help' для списка команд." << std::endl;
+        return CommandStatus::failed;
+    }
+    bool background = line.size() > 1 && line.back() == "&";
+    if (background && !spec->background) {
+        std::cout << "Команда '" << spec->name << "' не поддерживает фоновый режим" << std::endl;
+        return CommandStatus::failed;
+    }
+    // Копию без "&" получают только фоновые get/put, остальные строки передаются как есть.
+    std::vector<std::string> foreground;
+    if (background) foreground.assign(line.begin(), line.end() - 1);
+    const std::vector<std::string>& args = background ? foreground : line;
+
+    size_t count = args.size() - 1;
+    CommandStatus status = CommandStatus::usage;
+    if (count >= spec->min_args && count <= spec->max_args) {
+        auto session = ftp_client.lock_session();
+        CommandContext context{ ftp_client, local_manager, *spec, background };
+        status = spec->handler(context, args);
+    }
+    if (status == CommandStatus::usage) {
+        std::cout << "Использование: " << spec->usage << std::endl;
+        return CommandStatus::failed;
+    }
+    return status;
+}
+
+// Пакетный режим: соседние независимые get/put/mkdir объединяются в один шаг и идут
+// через пул соединений. Порядок шагов сохраняется, поэтому mkdir перед put в ту же
+// директорию по-прежнему выполняется первым; конфликтующие команды начинают новый шаг.
+struct BatchStep {
+    std::string kind;
+    std::vector<std::vector<std::string>> commands;
+};
+
+std::string batch_kind(const std::vector<std::string>& args) {
+    const CommandSpec* spec = find_command(args[0]);
+    if (!spec) return "";
+    std::string command(spec->name);
+    // Флаги (-c, --verify и т.п.) и фоновый запуск обрабатывает только обычный обработчик,
+    // поэтому такие команды в группу не попадают и выполняются отдельным шагом.
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i].empty() || args[i][0] == '-' || args[i] == "&") return "";
+    }
+    if ((command == "get" || command == "put") && args.size() == 3) return command;
+    if (command == "mkdir" && args.size() == 2) return command;
+    return "";
+}
+
+bool batch_conflicts(const std::string& kind, const std::vector<std::vector<std::string>>& group, const std::vector<std::string>& args) {
+    const std::string& target = kind == "mkdir" ? args[1] : args[2];
+    for (const auto& queued : group) {
+        const std::string& other = kind == "mkdir" ? queued[1] : queued[2];
+        if (other == target) return true;
+        if (kind == "mkdir" && target.size() > other.size() && target.compare(0, other.size(), other) == 0 && target[other.size()] == '/') return true;
+    }
+    return false;
+}
+
+// Выполняет один шаг пакета: одиночную команду через run_command или группу через пул.
+CommandStatus run_batch_step(FtpClient& ftp_client, LocalFileManager& local_manager, const BatchStep& step, size_t connections) {
+    CommandStatus status;
+    if (step.commands.size() == 1) {
+        std::string echo;
+        for (const auto& part : step.commands[0]) {
+            bool quoted = part.empty() || part.find_first_of(" \t") != std::string::npos;
+            echo += (echo.empty() ? "" : " ") + (quoted ? "\"" + part + "\"" : part);
         }
-        else if (command == "ls" || command == "dir") { ftp_client.list_directory(); }
-        else if (command == "cd") { 
-            if (args.size() == 2) { ftp_client.change_directory(args[1]); } else { std::cout << "Использование: cd <directory_name>" << std::endl; } 
+        std::cout << "> " << echo << std::endl;
+        status = run_command(ftp_client, local_manager, step.commands[0]);
+    } else {
+        std::cout << "> " << step.kind << " x" << step.commands.size() << " ("
+                  << (connections == TransferPool::adaptive_connections ? std::string("авто") : std::to_string(connections)) << " соединений)" << std::endl;
+        auto session = ftp_client.lock_session();
+        status = ftp_client.run_batch_group(step.kind, step.commands, connections) ? CommandStatus::ok : CommandStatus::failed;
+    }
+    auto session = ftp_client.lock_session();
+    ftp_client.report_finished_jobs();
+    return status;
+}
+
+// Скрипт читается построчно: в памяти держится только текущая группа, и она запускается,
+// как только очередная строка её закрывает. Так `-b -` работает и с бесконечным источником.
+int run_batch(FtpClient& ftp_client, LocalFileManager& local_manager, std::istream& script, size_t connections, bool stop_on_error) {
+    CommandLine parser;
+    BatchStep pending;
+    std::string line;
+    size_t failed = 0, line_number = 0;
+    bool stopped = false;
+    auto flush = [&]() {
+        if (pending.commands.empty()) return;
+        CommandStatus status = run_batch_step(ftp_client, local_manager, pending, connections);
+        pending.kind.clear();
+        pending.commands.clear();
+        if (status == CommandStatus::exit) stopped = true;
+        if (status == CommandStatus::failed) {
+            ++failed;
+            if (stop_on_error) stopped = true;
         }
-        else if (command == "mkdir") { 
-            if (args.size() == 2) { ftp_client.create_remote_directory(args[1]); } else { std::cout << "Использование: mkdir <directory_name>" << std::endl; } 
+    };
+    while (!stopped && std::getline(script, line)) {
+        ++line_number;
+        if (!parser.parse(line)) {
+            flush();
+            std::cerr << "Строка " << line_number << ": " << parser.last_error() << std::endl;
+            ++failed;
+            if (stop_on_error) break;
+            continue;
         }
-        else if (command == "rm") { 
-            if (args.size() == 3) { 
-                bool is_dir = (args[2] == "1" || args[2] == "true");
-                ftp_client.delete_remote_path(args[1], is_dir); 
-            } else { std::cout << "Использование: rm <name> <is_dir(0|1)>" << std::endl; } 
+        if (parser.empty()) continue;
+        std::vector<std::string> args;
+        parser.to_args(args);
+        std::string kind = batch_kind(args);
+        if (!kind.empty() && !pending.commands.empty() && pending.kind == kind && !batch_conflicts(kind, pending.commands, args)) {
+            pending.commands.push_back(std::move(args));
+            continue;
         }
-        else if (command == "get") { 
-            if (args.size() == 3) { ftp_client.download(args[1], args[2]); } else { std::cout << "Использование: get <remote_file> <local_file>" << std::endl; } 
+        flush();
+        if (stopped) break;
+        pending.kind = kind;
+        pending.commands.push_back(std::move(args));
+        // Команда, которую нельзя объединить, выполняется сразу, не дожидаясь следующей строки.
+        if (kind.empty()) flush();
+    }
+    if (!stopped) flush();
+    auto session = ftp_client.lock_session();
+    ftp_client.wait_job(0);
+    return failed == 0 ? 0 : 1;
+}
+
+#ifndef FTP_CLIENT_NO_MAIN
+int main(int argc, char* argv[]) {
+    FtpClient ftp_client;
+    LocalFileManager local_manager;
+
+    std::string script_path;
+    bool stop_on_error = false;
+    size_t connections = 4;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-b" && i + 1 < argc) { script_path = argv[++i]; }
+        else if (arg == "-e") { stop_on_error = true; }
+        else if (arg == "-j" && i + 1 < argc) {
+            if (!parse_connections(argv[++i], connections)) { std::cerr << "Число соединений должно быть положительным или auto" << std::endl; return 2; }
         }
-        else if (command == "put") { 
-            if (args.size() == 3) { ftp_client.upload(args[1], args[2]); } else { std::cout << "Использование: put <local_file> <remote_file>" << std::endl; } 
+        else {
+            std::cerr << "Использование: " << argv[0] << " [-b <script|->] [-e] [-j N]" << std::endl;
+            return 2;
         }
-        else if (command == "lls" || command == "ldir") { local_manager.list_directory(); }
-        else if (command == "lcd") { 
-            if (args.size() == 2) { local_manager.change_directory(args[1]); } else { std::cout << "Использование: lcd <directory_name>" << std::endl; } 
+    }
+    if (!script_path.empty()) {
+        if (script_path == "-") return run_batch(ftp_client, local_manager, std::cin, connections, stop_on_error);
+        std::ifstream script(script_path);
+        if (!script) {
+            std::cerr << "Не удалось открыть сценарий '" << script_path << "'" << std::endl;
+            return 2;
         }
-        else if (command == "lmkdir") { 
-            if (args.size() == 2) { local_manager.create_directory(args[1]); } else { std::cout << "Использование: lmkdir <directory_name>" << std::endl; } 
+        return run_batch(ftp_client, local_manager, script, connections, stop_on_error);
+    }
+
+    std::string command_line;
+    CommandLine parser;
+    std::vector<std::string> args;
+    std::cout << "Простой интерактивный FTP-клиент/Файловый менеджер (C++17 required)" << std::endl;
+    display_help();
+
+    while (true) {
+        {
+            auto session = ftp_client.lock_session();
+            ftp_client.report_finished_jobs();
         }
-        else if (command == "lrm") { 
-            if (args.size() == 2) { local_manager.remove_path(args[1]); } else { std::cout << "Использование: lrm <path>" << std::endl; } 
+        std::cout << "\n" << "local:" << fs::current_path().filename().string() 
+                  << " | remote:" << fs::path(ftp_client.get_base_url()).filename().string() << "> ";
+        
+        if (!std::getline(std::cin, command_line)) {
+            std::cout << std::endl;
+            break;
         }
-        else if (command == "lmv") { 
-            if (args.size() == 3) { local_manager.move_path(args[1], args[2]); } else { std::cout << "Использование: lmv <from_path> <to_path>" << std::endl; } 
+
+        if (!parser.parse(command_line)) {
+            std::cout << "Ошибка разбора: " << parser.last_error() << std::endl;
+            continue;
         }
-        else { std::cout << "Неизвестная команда. Введите 'help' для списка команд." << std::endl; }
+        if (parser.empty()) continue;
+        parser.to_args(args);
+
+        if (run_command(ftp_client, local_manager, args) == CommandStatus::exit) break;
     }
 
     return 0;
 }
+#endif